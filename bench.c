@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "proto.h"
+
+// Load generator for main.go. Opens N framed connections, sends chat lines
+// stamped with the send time from a subset of them and measures how long
+// each broadcast takes to reach every member of the room.
+
+#define DEFAULT_PORT "8888"
+#define DEFAULT_CONNS 1000
+#define DEFAULT_SENDERS 10
+#define DEFAULT_RATE 100            // messages per second, over all senders
+#define DEFAULT_SECONDS 10
+#define DEFAULT_SIZE 64             // body bytes per message
+#define READY_TIMEOUT_MS 30000      // give up waiting for handshakes after this
+#define DRAIN_MS 2000               // keep reading this long after the last send
+#define SETTLE_MS 500               // input quiet this long before sending starts
+#define MAX_BURST 1000              // sends per wakeup when the loop falls behind
+#define IN_START 8192
+#define OUT_CAP 4096
+#define MAX_EVENTS 512
+#define BENCH_TAG "bench "
+
+#define OK_LINE " OK\n"
+
+// Padding for message bodies; plain text, so compression sees chat-like data
+#define FILLER "so I think we should probably look at that again later today, "
+
+enum { CONN_HANDSHAKE, CONN_READY, CONN_CLOSED };
+
+typedef struct {
+    int fd;
+    int state;
+    char *in;           // unparsed input; grows to hold one whole frame
+    size_t inlen, incap;
+    char out[OUT_CAP];  // what the socket has not taken yet
+    size_t outlen;
+} Conn;
+
+Conn *conns;
+int nconns = DEFAULT_CONNS;
+int nsenders = DEFAULT_SENDERS;
+long rate = DEFAULT_RATE;
+long seconds = DEFAULT_SECONDS;
+long msg_size = DEFAULT_SIZE;
+int use_deflate = 0;
+const char *room = NULL;    // joined after the handshake; the default room if NULL
+int epfd;
+int ready = 0, closed = 0;
+
+// Our messages start with run_tag, which is new for every run, and carry
+// a send time after run_start; the room replays earlier runs' messages on
+// join, and those must not count
+char run_tag[32];
+size_t run_tag_len;
+uint64_t run_start;
+uint64_t last_input;
+
+// Counters for the whole run and for the current second
+uint64_t sent = 0, received = 0, send_dropped = 0, wire_bytes = 0;
+uint64_t tick_sent = 0, tick_received = 0;
+
+// Log-linear latency histogram in nanoseconds: 16 sub-buckets per power of
+// two keeps every bucket within 6% of its value
+#define HIST_SUB 16
+uint64_t hist[64 * HIST_SUB];
+uint64_t hist_count = 0, hist_max = 0;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+// Smallest value that falls into bucket i
+uint64_t hist_value(int i) {
+    if (i < HIST_SUB) return i;
+    int e = i / HIST_SUB + 3;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - 4);
+}
+
+void hist_record(uint64_t v) {
+    hist[hist_index(v)]++;
+    hist_count++;
+    if (v > hist_max) hist_max = v;
+}
+
+uint64_t hist_percentile(double p) {
+    uint64_t want = (uint64_t)(p * hist_count), seen = 0;
+    if (want >= hist_count) want = hist_count - 1;
+    for (size_t i = 0; i < sizeof(hist) / sizeof(hist[0]); i++) {
+        seen += hist[i];
+        if (seen > want) return hist_value(i);
+    }
+    return hist_max;
+}
+
+// The server allows more users than the usual default descriptor limit
+void raise_file_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void conn_close(Conn *c) {
+    if (c->state == CONN_CLOSED) return;
+    if (c->state == CONN_READY) ready--;
+    c->state = CONN_CLOSED;
+    closed++;
+    close(c->fd);
+    free(c->in);
+    c->in = NULL;
+}
+
+// Write what the socket accepts and wait for EPOLLOUT for the rest
+void conn_flush(Conn *c) {
+    while (c->outlen > 0) {
+        ssize_t n = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            conn_close(c);
+            return;
+        }
+        memmove(c->out, c->out + n, c->outlen - n);
+        c->outlen -= n;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | (c->outlen ? EPOLLOUT : 0), .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void conn_queue(Conn *c, const char *data, size_t len) {
+    if (c->outlen + len > OUT_CAP) {
+        send_dropped++;
+        return;
+    }
+    memcpy(c->out + c->outlen, data, len);
+    c->outlen += len;
+    conn_flush(c);
+}
+
+// Start a non-blocking connect and queue the username line right away;
+// the server reads it once it has written its prompt
+int conn_open(Conn *c, struct addrinfo *ai, int id) {
+    char line[64];
+    int on = 1;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+    if (c->fd < 0) return -1;
+    if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        return -1;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    c->in = malloc(IN_START);
+    c->incap = IN_START;
+    c->state = CONN_HANDSHAKE;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+
+    int n = snprintf(line, sizeof(line), "%s%s bench%d\n", PROTO_MAGIC,
+                     use_deflate ? PROTO_DEFLATE : "", id);
+    memcpy(c->out, line, n);
+    c->outlen = n;
+
+    // Frames may follow the username right away
+    if (room) {
+        n = snprintf(line, sizeof(line), "/join %s", room);
+        Frame f = { .type = FRAME_SEND, .body = line, .body_len = n };
+        long len = frame_encode(c->out + c->outlen, OUT_CAP - c->outlen, &f);
+        if (len > 0) c->outlen += len;
+    }
+    return 0;
+}
+
+// A chat line from one of our senders carries its send time
+void handle_frame(const Frame *f) {
+    if ((f->type != FRAME_CHAT && f->type != FRAME_CHAT_SEQ) || f->body_len <= run_tag_len) return;
+    if (memcmp(f->body, run_tag, run_tag_len) != 0) return;
+
+    uint64_t stamp = strtoull(f->body + run_tag_len, NULL, 10);
+    if (stamp < run_start) return;
+
+    hist_record(now_ns() - stamp);
+    received++;
+    tick_received++;
+}
+
+// Time the frames packed into a compressed one
+int handle_deflated(const Frame *f) {
+    static char buf[PROTO_MAX_FRAME + PROTO_MAX_HEADER];
+    long len = frame_inflate(f->body, f->body_len, buf, sizeof(buf));
+    if (len < 0) return -1;
+
+    Frame inner;
+    long n;
+    for (long off = 0; off < len; off += n) {
+        if ((n = frame_parse(buf + off, len - off, &inner)) <= 0) return -1;
+        handle_frame(&inner);
+    }
+    return 0;
+}
+
+// Consume whatever complete input the connection has
+void conn_parse(Conn *c) {
+    size_t off = 0;
+
+    if (c->state == CONN_HANDSHAKE) {
+        // The prompt has no newline, so the first line ends with the
+        // server's answer, with or without compression; anything but an OK
+        // is a refusal
+        char *eol = memchr(c->in, '\n', c->inlen);
+        if (!eol) return;
+        off = eol + 1 - c->in;
+        if (off < strlen(OK_LINE) || memcmp(eol + 1 - strlen(OK_LINE), OK_LINE, strlen(OK_LINE)) != 0) {
+            conn_close(c);
+            return;
+        }
+        c->state = CONN_READY;
+        ready++;
+    }
+
+    while (off < c->inlen) {
+        Frame f;
+        long n = frame_parse(c->in + off, c->inlen - off, &f);
+        if (n < 0) {
+            conn_close(c);
+            return;
+        }
+        if (n == 0) break;
+        if (f.type != FRAME_DEFLATE) {
+            handle_frame(&f);
+        } else if (handle_deflated(&f) < 0) {
+            conn_close(c);
+            return;
+        }
+        off += n;
+    }
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+}
+
+void conn_read(Conn *c) {
+    while (c->state != CONN_CLOSED) {
+        // A frame bigger than the buffer: grow it up to the protocol limit
+        if (c->inlen == c->incap) {
+            size_t cap = c->incap * 2;
+            char *grown = cap <= 2 * PROTO_MAX_FRAME ? realloc(c->in, cap) : NULL;
+            if (!grown) {
+                conn_close(c);
+                return;
+            }
+            c->in = grown;
+            c->incap = cap;
+        }
+
+        ssize_t n = recv(c->fd, c->in + c->inlen, c->incap - c->inlen, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn_close(c);
+            return;
+        }
+        if (n == 0) {
+            conn_close(c);
+            return;
+        }
+        c->inlen += n;
+        wire_bytes += n;
+        last_input = now_ns();
+        conn_parse(c);
+    }
+}
+
+// Send one stamped message from the next sender in turn
+void send_one() {
+    static int next = 0;
+    static char *body;
+
+    if (!body) body = malloc(msg_size + run_tag_len + 32);
+
+    for (int tries = 0; tries < nsenders; tries++) {
+        Conn *c = &conns[next];
+        next = (next + 1) % nsenders;
+        if (c->state != CONN_READY) continue;
+
+        int n = snprintf(body, msg_size + run_tag_len + 32, "%s%llu ", run_tag, (unsigned long long)now_ns());
+        for (; n < msg_size; n++) body[n] = FILLER[n % strlen(FILLER)];
+
+        char out[OUT_CAP];
+        Frame f = { .type = FRAME_SEND, .body = body, .body_len = n };
+        long len = frame_encode(out, sizeof(out), &f);
+        if (len < 0) {
+            send_dropped++;
+            return;
+        }
+        conn_queue(c, out, len);
+        sent++;
+        tick_sent++;
+        return;
+    }
+}
+
+void handle_events(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        Conn *c = events[i].data.ptr;
+        if (c->state == CONN_CLOSED) continue;
+        if (events[i].events & EPOLLOUT) conn_flush(c);
+        if (c->state != CONN_CLOSED && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            conn_read(c);
+        }
+    }
+}
+
+void report() {
+    double secs = seconds > 0 ? seconds : 1;
+    uint64_t expected = sent * (uint64_t)nconns;
+
+    printf("\n");
+    printf("connections   %d (%d closed)\n", nconns, closed);
+    printf("sent          %llu msgs, %.0f msgs/sec", (unsigned long long)sent, sent / secs);
+    if (send_dropped) printf(", %llu not sent (socket full)", (unsigned long long)send_dropped);
+    printf("\n");
+    printf("delivered     %llu msgs, %.0f msgs/sec, %.2f%% of fan-out\n",
+           (unsigned long long)received, received / secs,
+           expected ? 100.0 * received / expected : 0.0);
+    printf("inbound       %.1f MiB, %.2f MiB/sec%s\n", wire_bytes / 1048576.0,
+           wire_bytes / 1048576.0 / secs, use_deflate ? " (deflate)" : "");
+    if (hist_count == 0) return;
+    printf("latency p50   %.3f ms\n", hist_percentile(0.50) / 1e6);
+    printf("latency p99   %.3f ms\n", hist_percentile(0.99) / 1e6);
+    printf("latency p999  %.3f ms\n", hist_percentile(0.999) / 1e6);
+    printf("latency max   %.3f ms\n", hist_max / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "localhost";
+    const char *port = DEFAULT_PORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:r:d:m:j:z")) != -1) {
+        if (opt == 'c' && (nconns = atoi(optarg)) > 0) continue;
+        if (opt == 's' && (nsenders = atoi(optarg)) > 0) continue;
+        if (opt == 'r' && (rate = atol(optarg)) > 0) continue;
+        if (opt == 'd' && (seconds = atol(optarg)) > 0) continue;
+        if (opt == 'm' && (msg_size = atol(optarg)) > 0 && msg_size < OUT_CAP - PROTO_MAX_HEADER) continue;
+        if (opt == 'j' && strlen(optarg) < 32) {
+            room = optarg;
+            continue;
+        }
+        if (opt == 'z') {
+            use_deflate = 1;
+            continue;
+        }
+        fprintf(stderr, "Usage: %s [-c connections] [-s senders] [-r msgs_per_sec] "
+                "[-d seconds] [-m msg_bytes] [-j room] [-z] [host [port]]\n", argv[0]);
+        return 1;
+    }
+    if (optind < argc) host = argv[optind++];
+    if (optind < argc) port = argv[optind++];
+    if (nsenders > nconns) nsenders = nconns;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", host, gai_strerror(err));
+        return 1;
+    }
+
+    raise_file_limit();
+    epfd = epoll_create1(0);
+    conns = calloc(nconns, sizeof(Conn));
+    if (epfd < 0 || !conns) {
+        fprintf(stderr, "Cannot set up %d connections\n", nconns);
+        return 1;
+    }
+
+    // Tag this run's messages before anything can arrive
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    unsigned long long nonce = ((unsigned long long)wall.tv_sec << 32) ^ wall.tv_nsec ^ getpid();
+    run_tag_len = snprintf(run_tag, sizeof(run_tag), BENCH_TAG "%llx ", nonce);
+    run_start = now_ns();
+
+    // Connect everybody and wait for the handshakes
+    uint64_t start = run_start;
+    for (int i = 0; i < nconns; i++) {
+        if (conn_open(&conns[i], res, i) < 0) {
+            fprintf(stderr, "Cannot open connection %d: %s\n", i, strerror(errno));
+            return 1;
+        }
+    }
+    freeaddrinfo(res);
+
+    while (ready + closed < nconns && now_ns() - start < READY_TIMEOUT_MS * 1000000ULL) {
+        handle_events(100);
+    }
+    printf("%d/%d connections ready in %.2f s\n", ready, nconns, (now_ns() - start) / 1e9);
+    if (ready == 0) return 1;
+
+    // Every join is announced to the whole room; let that storm pass so it
+    // doesn't count against the first messages
+    while (now_ns() - last_input < SETTLE_MS * 1000000ULL) {
+        handle_events(100);
+    }
+    printf("join notices settled after %.2f s\n", (now_ns() - start) / 1e9);
+
+    // Send at a fixed rate, printing a line per second
+    uint64_t send_start = now_ns();
+    uint64_t interval = 1000000000ULL / rate;
+    uint64_t next_send = send_start, next_tick = send_start + 1000000000ULL;
+    uint64_t end = send_start + seconds * 1000000000ULL;
+    uint64_t now;
+
+    while ((now = now_ns()) < end + DRAIN_MS * 1000000ULL) {
+        for (int burst = 0; now < end && next_send <= now && burst < MAX_BURST; burst++) {
+            send_one();
+            next_send += interval;
+        }
+        // Falling further behind than one burst: skip ahead instead of
+        // sending an ever larger backlog
+        if (next_send < now) next_send = now;
+
+        if (now >= next_tick) {
+            printf("%3llus  sent %6llu/s  delivered %8llu/s  p99 %.3f ms\n",
+                   (unsigned long long)((next_tick - send_start) / 1000000000ULL),
+                   (unsigned long long)tick_sent, (unsigned long long)tick_received,
+                   hist_count ? hist_percentile(0.99) / 1e6 : 0.0);
+            fflush(stdout);
+            tick_sent = tick_received = 0;
+            next_tick += 1000000000ULL;
+        }
+
+        uint64_t wake = now < end ? next_send : next_tick;
+        if (wake > next_tick) wake = next_tick;
+        handle_events(wake > now ? (wake - now + 999999) / 1000000 : 0);
+    }
+
+    report();
+    return 0;
+}
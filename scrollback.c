@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include "scrollback.h"
+
+int sb_init(Scrollback *sb, size_t max_lines, size_t arena_bytes) {
+    memset(sb, 0, sizeof(*sb));
+    if (max_lines == 0 || arena_bytes == 0) return -1;
+
+    sb->recs = calloc(max_lines, sizeof(Record));
+    if (!sb->recs) return -1;
+    sb->cap = max_lines;
+    sb->arena_limit = arena_bytes;
+    sb->chunk_size = arena_bytes < SB_CHUNK ? arena_bytes : SB_CHUNK;
+    return 0;
+}
+
+void sb_free(Scrollback *sb) {
+    while (sb->oldest) {
+        SbChunk *c = sb->oldest;
+        sb->oldest = c->next;
+        free(c);
+    }
+    free(sb->spare);
+    free(sb->recs);
+    memset(sb, 0, sizeof(*sb));
+}
+
+// Drop the oldest chunks whose records have all been evicted. The newest
+// one is still being filled and stays unless drop_newest is set.
+static void sb_release(Scrollback *sb, int drop_newest) {
+    while (sb->oldest && sb->oldest->end <= sb->head &&
+           (sb->oldest != sb->newest || drop_newest)) {
+        SbChunk *c = sb->oldest;
+        sb->oldest = c->next;
+        if (!sb->oldest) sb->newest = NULL;
+        sb->arena_bytes -= c->size;
+        sb->text_bytes -= c->used;
+
+        if (!sb->spare && c->size == sb->chunk_size) {
+            sb->spare = c;
+        } else {
+            free(c);
+        }
+    }
+}
+
+// Make room for n bytes of text at the end of the newest chunk, evicting
+// records until a new chunk fits the budget. Returns NULL if out of memory.
+static char *sb_reserve(Scrollback *sb, size_t n) {
+    SbChunk *c = sb->newest;
+    if (c && c->size - c->used >= n) return c->data + c->used;
+
+    size_t size = n > sb->chunk_size ? n : sb->chunk_size;
+    while (sb->arena_bytes + size > sb->arena_limit && sb->head < sb->tail) {
+        sb->head++;
+        sb_release(sb, 1);
+    }
+    sb_release(sb, 1);
+
+    if (size == sb->chunk_size && sb->spare) {
+        c = sb->spare;
+        sb->spare = NULL;
+    } else {
+        c = malloc(sizeof(SbChunk) + size);
+        if (!c) return NULL;
+        c->size = size;
+    }
+    c->next = NULL;
+    c->used = 0;
+    c->end = sb->tail;
+
+    if (sb->newest) {
+        sb->newest->next = c;
+    } else {
+        sb->oldest = c;
+    }
+    sb->newest = c;
+    sb->arena_bytes += size;
+    return c->data;
+}
+
+uint64_t sb_append(Scrollback *sb, int kind, time_t ts,
+                   const char *author, size_t author_len,
+                   const char *body, size_t body_len) {
+    size_t limit = sb->arena_limit;
+
+    if (author_len > UINT16_MAX) author_len = UINT16_MAX;
+    if (author_len > limit / 2) author_len = limit / 2;
+    if (author_len + body_len > limit) body_len = limit - author_len;
+    if (body_len > UINT32_MAX) body_len = UINT32_MAX;
+    size_t n = author_len + body_len;
+
+    // Evict for the line cap first; that may free a chunk for this text
+    while (sb->tail - sb->head >= sb->cap) sb->head++;
+    sb_release(sb, 0);
+
+    const char *text = "";
+    char *dst = sb_reserve(sb, n);
+    if (dst) {
+        memcpy(dst, author, author_len);
+        memcpy(dst + author_len, body, body_len);
+        sb->newest->used += n;
+        sb->newest->end = sb->tail + 1;
+        sb->text_bytes += n;
+        text = dst;
+    } else {
+        // Out of memory: keep the record, without its text
+        author_len = body_len = 0;
+    }
+
+    Record *r = &sb->recs[sb->tail % sb->cap];
+    r->ts = ts;
+    r->text = text;
+    r->author_len = author_len;
+    r->body_len = body_len;
+    r->kind = kind;
+
+    return sb->tail++;
+}
+
+const Record *sb_get(const Scrollback *sb, uint64_t seq) {
+    if (seq < sb->head || seq >= sb->tail) return NULL;
+    return &sb->recs[seq % sb->cap];
+}
+
+size_t sb_memory(const Scrollback *sb) {
+    return sb->cap * sizeof(Record) + sb->arena_bytes + (sb->spare ? sb->spare->size : 0);
+}
+
+size_t sb_text_bytes(const Scrollback *sb) {
+    return sb->text_bytes;
+}
@@ -0,0 +1,84 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Message history as a fixed-capacity ring of records whose text is bump
+// allocated from a chain of arena chunks. Records are addressed by a
+// monotonically increasing sequence number; appending past either limit
+// evicts the oldest records. A chunk goes as a whole once its last record
+// is evicted and is kept as the spare for the next one, so steady ingest
+// makes no heap calls and memory stays flat however long the session runs.
+
+#define SB_CHUNK (64 * 1024)
+
+enum {
+    SB_CHAT,    // "[time] author: body"
+    SB_SYSTEM   // body only (notices, help text, server banners)
+};
+
+typedef struct {
+    time_t ts;
+    const char *text;       // author, body follows directly
+    uint32_t body_len;
+    uint16_t author_len;
+    uint8_t kind;
+} Record;
+
+// Text of the records before end, oldest chunk first. A text bigger than
+// the chunk size gets a chunk of its own.
+typedef struct SbChunk {
+    struct SbChunk *next;
+    size_t size;
+    size_t used;
+    uint64_t end;           // sequence number after its last record
+    char data[];
+} SbChunk;
+
+typedef struct {
+    Record *recs;
+    size_t cap;             // line cap
+    uint64_t head;          // sequence number of the oldest live record
+    uint64_t tail;          // sequence number the next record will get
+    SbChunk *oldest, *newest;
+    SbChunk *spare;         // released chunk kept for reuse
+    size_t chunk_size;
+    size_t arena_limit;     // byte budget for all chunks
+    size_t arena_bytes;     // size of the chunks in the chain
+    size_t text_bytes;      // bytes written into them
+} Scrollback;
+
+int sb_init(Scrollback *sb, size_t max_lines, size_t arena_bytes);
+void sb_free(Scrollback *sb);
+
+// Append one record; over-long bodies are truncated to fit the arena.
+// Returns the sequence number of the new record.
+uint64_t sb_append(Scrollback *sb, int kind, time_t ts,
+                   const char *author, size_t author_len,
+                   const char *body, size_t body_len);
+
+// Record for seq, or NULL if it was evicted or not written yet
+const Record *sb_get(const Scrollback *sb, uint64_t seq);
+
+static inline const char *sb_author(const Scrollback *sb, const Record *r) {
+    (void)sb;
+    return r->text;
+}
+
+static inline const char *sb_body(const Scrollback *sb, const Record *r) {
+    return sb_author(sb, r) + r->author_len;
+}
+
+static inline size_t sb_count(const Scrollback *sb) {
+    return sb->tail - sb->head;
+}
+
+// Bytes held by the ring and the chunks
+size_t sb_memory(const Scrollback *sb);
+
+// Text bytes in the chunks still holding live records
+size_t sb_text_bytes(const Scrollback *sb);
+
+#endif
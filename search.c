@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <string.h>
+#include "search.h"
+
+#define SI_BLOCK 11             // postings per block, 32 bytes with the header
+#define SI_PAGE (16 * 1024)     // posting block arena page
+#define SI_MAX_WORD 32          // longer words are indexed by their start
+#define SI_WORDS (SI_SEGMENT / 64)
+
+typedef struct SiBlock {
+    struct SiBlock *next;
+    uint16_t n;
+    uint16_t off[SI_BLOCK];     // record offsets within the segment
+} SiBlock;
+
+typedef struct {
+    uint64_t hash;              // 0 marks an empty slot
+    SiBlock *first, *last;
+    uint16_t last_off;          // so a word repeated in a record counts once
+} SiEntry;
+
+typedef struct SiPage {
+    struct SiPage *next;
+    size_t used;
+    char data[SI_PAGE];
+} SiPage;
+
+struct SiSegment {
+    SiSegment *next, *prev;     // towards the newest and the oldest
+    uint64_t base;              // sequence number of its first record
+    uint64_t end;               // after its last indexed record
+    SiEntry *table;
+    size_t mask, used;
+    SiPage *pages;
+};
+
+void si_init(SearchIndex *si) {
+    memset(si, 0, sizeof(*si));
+}
+
+static size_t segment_bytes(const SiSegment *s) {
+    size_t n = sizeof(*s) + (s->mask + 1) * sizeof(SiEntry);
+    for (const SiPage *p = s->pages; p; p = p->next) n += sizeof(SiPage);
+    return n;
+}
+
+static void segment_free(SiSegment *s) {
+    while (s->pages) {
+        SiPage *p = s->pages;
+        s->pages = p->next;
+        free(p);
+    }
+    free(s->table);
+    free(s);
+}
+
+void si_free(SearchIndex *si) {
+    while (si->oldest) {
+        SiSegment *s = si->oldest;
+        si->oldest = s->next;
+        segment_free(s);
+    }
+    memset(si, 0, sizeof(*si));
+}
+
+static int word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c >= 0x80;
+}
+
+// Hash the next word at or after *pos, advancing past it. Returns 0 once
+// there are no more words.
+static uint64_t next_word(const char *text, size_t len, size_t *pos) {
+    size_t i = *pos;
+    while (i < len && !word_byte(text[i])) i++;
+    if (i == len) {
+        *pos = i;
+        return 0;
+    }
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t n = 0; i < len && word_byte(text[i]); i++, n++) {
+        if (n >= SI_MAX_WORD) continue;
+        unsigned char c = text[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    *pos = i;
+    return h ? h : 1;
+}
+
+static SiEntry *lookup(const SiSegment *s, uint64_t hash) {
+    for (size_t i = hash & s->mask;; i = (i + 1) & s->mask) {
+        if (s->table[i].hash == hash || s->table[i].hash == 0) return &s->table[i];
+    }
+}
+
+// Double the word table once it is half full
+static int grow(SiSegment *s) {
+    size_t cap = (s->mask + 1) * 2;
+    SiEntry *old = s->table, *table = calloc(cap, sizeof(SiEntry));
+    if (!table) return -1;
+    size_t old_cap = s->mask + 1;
+    s->table = table;
+    s->mask = cap - 1;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].hash) *lookup(s, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static SiBlock *new_block(SiSegment *s) {
+    SiPage *p = s->pages;
+    if (!p || p->used + sizeof(SiBlock) > SI_PAGE) {
+        if (!(p = malloc(sizeof(SiPage)))) return NULL;
+        p->used = 0;
+        p->next = s->pages;
+        s->pages = p;
+    }
+    SiBlock *b = (SiBlock *)(p->data + p->used);
+    p->used += sizeof(SiBlock);
+    b->next = NULL;
+    b->n = 0;
+    return b;
+}
+
+static SiSegment *new_segment(uint64_t base) {
+    SiSegment *s = calloc(1, sizeof(SiSegment));
+    if (!s) return NULL;
+    s->table = calloc(256, sizeof(SiEntry));
+    if (!s->table) {
+        free(s);
+        return NULL;
+    }
+    s->mask = 255;
+    s->base = s->end = base;
+    return s;
+}
+
+void si_add(SearchIndex *si, uint64_t seq, const char *text, size_t len) {
+    SiSegment *s = si->newest;
+    if (!s || seq >= s->base + SI_SEGMENT) {
+        if (!(s = new_segment(seq - seq % SI_SEGMENT))) return;
+        if (si->newest) {
+            si->newest->next = s;
+            s->prev = si->newest;
+        } else {
+            si->oldest = s;
+        }
+        si->newest = s;
+        si->bytes += segment_bytes(s);
+    }
+
+    size_t before = segment_bytes(s);
+    uint16_t off = seq - s->base;
+    size_t pos = 0;
+    uint64_t hash;
+    while ((hash = next_word(text, len, &pos)) != 0) {
+        if (s->used * 2 >= s->mask + 1 && grow(s) < 0) break;
+        SiEntry *e = lookup(s, hash);
+        if (e->hash == 0) {
+            e->hash = hash;
+            s->used++;
+        } else if (e->last && e->last_off == off) {
+            continue;
+        }
+        if (!e->last || e->last->n == SI_BLOCK) {
+            SiBlock *b = new_block(s);
+            if (!b) break;
+            if (e->last) {
+                e->last->next = b;
+            } else {
+                e->first = b;
+            }
+            e->last = b;
+        }
+        e->last->off[e->last->n++] = off;
+        e->last_off = off;
+    }
+    s->end = seq + 1;
+    si->bytes += segment_bytes(s) - before;
+}
+
+void si_evict(SearchIndex *si, uint64_t head) {
+    while (si->oldest && si->oldest != si->newest && si->oldest->end <= head) {
+        SiSegment *s = si->oldest;
+        si->oldest = s->next;
+        si->oldest->prev = NULL;
+        si->bytes -= segment_bytes(s);
+        segment_free(s);
+    }
+}
+
+// Split a query into word hashes. Returns how many, at most SI_MAX_TERMS.
+static int query_terms(const char *query, uint64_t *terms) {
+    size_t pos = 0, len = strlen(query);
+    int n = 0;
+    uint64_t hash;
+    while (n < SI_MAX_TERMS && (hash = next_word(query, len, &pos)) != 0) terms[n++] = hash;
+    return n;
+}
+
+// The records of segment s in [head, before) holding every term, as a
+// bitmap of offsets. Returns 0 if there are none.
+static int segment_matches(const SiSegment *s, const uint64_t *terms, int n,
+                           uint64_t head, uint64_t before, uint64_t *bits) {
+    uint64_t lo = head > s->base ? head - s->base : 0;
+    uint64_t hi = before < s->end ? before - s->base : s->end - s->base;
+    if (lo >= hi) return 0;
+
+    for (int w = 0; w < SI_WORDS; w++) bits[w] = ~0ULL;
+    for (int t = 0; t < n; t++) {
+        const SiEntry *e = lookup(s, terms[t]);
+        if (e->hash == 0) return 0;
+        uint64_t term[SI_WORDS] = { 0 };
+        for (const SiBlock *b = e->first; b; b = b->next) {
+            for (int i = 0; i < b->n; i++) term[b->off[i] / 64] |= 1ULL << (b->off[i] % 64);
+        }
+        for (int w = 0; w < SI_WORDS; w++) bits[w] &= term[w];
+    }
+
+    // Clip to [lo, hi)
+    int any = 0;
+    for (int w = 0; w < SI_WORDS; w++) {
+        uint64_t first = (uint64_t)w * 64;
+        if (first + 64 <= lo || first >= hi) {
+            bits[w] = 0;
+            continue;
+        }
+        if (lo > first) bits[w] &= ~0ULL << (lo - first);
+        if (hi < first + 64) bits[w] &= (1ULL << (hi - first)) - 1;
+        any |= bits[w] != 0;
+    }
+    return any;
+}
+
+uint64_t si_find(const SearchIndex *si, const char *query, uint64_t head, uint64_t before) {
+    uint64_t terms[SI_MAX_TERMS], bits[SI_WORDS];
+    int n = query_terms(query, terms);
+    if (n == 0) return SI_NONE;
+
+    // Walk back from the newest segment; the first one with a match holds
+    // the newest match
+    for (const SiSegment *s = si->newest; s && s->end > head; s = s->prev) {
+        if (s->base >= before || !segment_matches(s, terms, n, head, before, bits)) continue;
+        for (int w = SI_WORDS - 1; w >= 0; w--) {
+            if (bits[w]) return s->base + (uint64_t)w * 64 + 63 - __builtin_clzll(bits[w]);
+        }
+    }
+    return SI_NONE;
+}
+
+size_t si_count(const SearchIndex *si, const char *query, uint64_t head, uint64_t before) {
+    uint64_t terms[SI_MAX_TERMS], bits[SI_WORDS];
+    int n = query_terms(query, terms);
+    size_t count = 0;
+    if (n == 0) return 0;
+    for (const SiSegment *s = si->oldest; s && s->base < before; s = s->next) {
+        if (!segment_matches(s, terms, n, head, before, bits)) continue;
+        for (int w = 0; w < SI_WORDS; w++) count += __builtin_popcountll(bits[w]);
+    }
+    return count;
+}
@@ -0,0 +1,43 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Inverted index over the scrollback: every word maps to the records that
+// contain it. Records are grouped into segments of SI_SEGMENT consecutive
+// sequence numbers, each with its own word table and bump allocated
+// posting blocks. A segment goes in one piece once the scrollback has
+// evicted all of its records, so eviction never walks the postings.
+//
+// Words are runs of letters, digits, '_' and non-ASCII bytes, compared
+// without ASCII case and kept only as 64-bit hashes. A query matches the
+// records holding all of its words.
+
+#define SI_SEGMENT 1024
+#define SI_MAX_TERMS 8
+#define SI_NONE UINT64_MAX
+
+typedef struct SiSegment SiSegment;
+
+typedef struct {
+    SiSegment *oldest, *newest;
+    size_t bytes;           // held by all segments
+} SearchIndex;
+
+void si_init(SearchIndex *si);
+void si_free(SearchIndex *si);
+
+// Index the words of record seq. Records must be added in sequence order.
+void si_add(SearchIndex *si, uint64_t seq, const char *text, size_t len);
+
+// Drop the segments whose records all come before head
+void si_evict(SearchIndex *si, uint64_t head);
+
+// Newest record in [head, before) matching query, or SI_NONE
+uint64_t si_find(const SearchIndex *si, const char *query, uint64_t head, uint64_t before);
+
+// Records in [head, before) matching query
+size_t si_count(const SearchIndex *si, const char *query, uint64_t head, uint64_t before);
+
+#endif
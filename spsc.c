@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spsc.h"
+
+// Each record is a size_t length and the bytes, padded to ALIGN
+#define ALIGN 8
+#define SKIP SIZE_MAX   // length marking the rest of the buffer unused
+
+static size_t record_bytes(size_t size) {
+    return (sizeof(size_t) + size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+}
+
+int spsc_init(Spsc *q, size_t capacity) {
+    size_t cap = 64;
+    while (cap < capacity) cap <<= 1;
+    memset(q, 0, sizeof(*q));
+    q->buf = malloc(cap);
+    if (!q->buf) return -1;
+    q->mask = cap - 1;
+    return 0;
+}
+
+void spsc_free(Spsc *q) {
+    free(q->buf);
+    q->buf = NULL;
+}
+
+void *spsc_reserve(Spsc *q, size_t size) {
+    size_t cap = q->mask + 1, need = record_bytes(size);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t to_end = cap - (tail & q->mask);
+    size_t skip = to_end < need ? to_end : 0;
+    if (need > cap) return NULL;
+
+    if (tail + skip + need - q->head_seen > cap) {
+        q->head_seen = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail + skip + need - q->head_seen > cap) return NULL;
+    }
+    if (skip) {
+        *(size_t *)(q->buf + (tail & q->mask)) = SKIP;
+        tail += skip;
+    }
+    *(size_t *)(q->buf + (tail & q->mask)) = size;
+    q->next_tail = tail + need;
+    return q->buf + (tail & q->mask) + sizeof(size_t);
+}
+
+void spsc_push(Spsc *q) {
+    atomic_store_explicit(&q->tail, q->next_tail, memory_order_release);
+}
+
+void *spsc_peek(Spsc *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        if (head == q->tail_seen) {
+            q->tail_seen = atomic_load_explicit(&q->tail, memory_order_acquire);
+            if (head == q->tail_seen) return NULL;
+        }
+        size_t size = *(size_t *)(q->buf + (head & q->mask));
+        if (size != SKIP) {
+            q->next_head = head + record_bytes(size);
+            return q->buf + (head & q->mask) + sizeof(size_t);
+        }
+        head += q->mask + 1 - (head & q->mask);
+        atomic_store_explicit(&q->head, head, memory_order_release);
+    }
+}
+
+void spsc_pop(Spsc *q) {
+    atomic_store_explicit(&q->head, q->next_head, memory_order_release);
+}
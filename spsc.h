@@ -0,0 +1,48 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Bounded lock-free ring of variable-size records from exactly one
+// producer thread to exactly one consumer thread, in one buffer allocated
+// up front. The producer reserves room for a record, fills it in place and
+// pushes it; the consumer peeks at the oldest record, uses it in place and
+// pops it. A record never wraps: one that would is put at the start of
+// the buffer behind a skip marker.
+//
+// head and tail are byte positions that only grow. Only the producer
+// writes tail and only the consumer writes head; the release store of one
+// hands the bytes it passed to the other side. Each side caches the
+// other's position and only reloads it when the ring looks full or empty,
+// so the shared cache lines bounce once per batch rather than once per
+// record.
+
+typedef struct {
+    char *buf;
+    size_t mask;            // capacity - 1, capacity a power of two
+    _Atomic size_t head;    // start of the oldest record
+    size_t tail_seen;       // consumer's copy of tail
+    size_t next_head;       // head once the peeked record is popped
+    char pad[64];
+    _Atomic size_t tail;    // end of the newest pushed record
+    size_t head_seen;       // producer's copy of head
+    size_t next_tail;       // tail once the reserved record is pushed
+} Spsc;
+
+// Capacity in bytes is rounded up to a power of two. Returns -1 without
+// memory.
+int spsc_init(Spsc *q, size_t capacity);
+void spsc_free(Spsc *q);
+
+// Producer side: room for size bytes, 8-byte aligned, or NULL if the ring
+// is too full. spsc_push publishes the record last reserved.
+void *spsc_reserve(Spsc *q, size_t size);
+void spsc_push(Spsc *q);
+
+// Consumer side: the oldest record, NULL if there is none. It stays valid
+// until spsc_pop releases it.
+void *spsc_peek(Spsc *q);
+void spsc_pop(Spsc *q);
+
+#endif
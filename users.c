@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+#include "users.h"
+
+void us_init(UserSet *us) {
+    memset(us, 0, sizeof(*us));
+    us->seed = 2463534242u;
+}
+
+static void free_tree(User *n) {
+    if (!n) return;
+    free_tree(n->left);
+    free_tree(n->right);
+    free(n);
+}
+
+void us_clear(UserSet *us) {
+    free_tree(us->root);
+    us->root = NULL;
+    us->total = 0;
+}
+
+void us_free(UserSet *us) {
+    us_clear(us);
+}
+
+static int name_cmp(const char *a, const char *b, size_t blen) {
+    int c = strncmp(a, b, blen);
+    if (c != 0) return c;
+    return a[blen] != '\0';
+}
+
+static size_t size_of(const User *n) {
+    return n ? n->size : 0;
+}
+
+static void update(User *n) {
+    n->size = 1 + size_of(n->left) + size_of(n->right);
+}
+
+static User *rotate_right(User *n) {
+    User *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    update(n);
+    update(l);
+    return l;
+}
+
+static User *rotate_left(User *n) {
+    User *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    update(n);
+    update(r);
+    return r;
+}
+
+// Insert node, or bump the count of an existing name (node is then left
+// unused). Adds the rank of the name to *rank.
+static User *insert(User *n, User *node, size_t len, size_t *rank, int *used) {
+    if (!n) {
+        *used = 1;
+        return node;
+    }
+    int c = name_cmp(n->name, node->name, len);
+    if (c == 0) {
+        n->count++;
+        *rank += size_of(n->left);
+        return n;
+    }
+    if (c > 0) {
+        n->left = insert(n->left, node, len, rank, used);
+        if (n->left->prio > n->prio) return rotate_right(n);
+    } else {
+        *rank += size_of(n->left) + 1;
+        n->right = insert(n->right, node, len, rank, used);
+        if (n->right->prio > n->prio) return rotate_left(n);
+    }
+    update(n);
+    return n;
+}
+
+long us_add(UserSet *us, const char *name, size_t len) {
+    User *node = malloc(sizeof(User) + len + 1);
+    if (!node) return -1;
+    memcpy(node->name, name, len);
+    node->name[len] = '\0';
+    node->left = node->right = NULL;
+    node->size = 1;
+    node->count = 1;
+    
+    // xorshift; the priorities only need to look random
+    us->seed ^= us->seed << 13;
+    us->seed ^= us->seed >> 17;
+    us->seed ^= us->seed << 5;
+    node->prio = us->seed;
+    
+    size_t rank = 0;
+    int used = 0;
+    us->root = insert(us->root, node, len, &rank, &used);
+    if (!used) free(node);
+    us->total++;
+    return rank;
+}
+
+static User *merge(User *a, User *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b->left = merge(a, b->left);
+    update(b);
+    return b;
+}
+
+static User *erase(User *n, const char *name, size_t len, long *rank) {
+    if (!n) {
+        *rank = -1;
+        return NULL;
+    }
+    int c = name_cmp(n->name, name, len);
+    if (c == 0) {
+        *rank += size_of(n->left);
+        if (--n->count > 0) return n;
+        User *m = merge(n->left, n->right);
+        free(n);
+        return m;
+    }
+    if (c > 0) {
+        n->left = erase(n->left, name, len, rank);
+    } else {
+        *rank += size_of(n->left) + 1;
+        n->right = erase(n->right, name, len, rank);
+    }
+    update(n);
+    return n;
+}
+
+long us_remove(UserSet *us, const char *name, size_t len) {
+    long rank = 0;
+    us->root = erase(us->root, name, len, &rank);
+    if (rank >= 0) us->total--;
+    return rank;
+}
+
+const User *us_at(const UserSet *us, size_t rank) {
+    const User *n = us->root;
+    while (n) {
+        size_t left = size_of(n->left);
+        if (rank < left) {
+            n = n->left;
+        } else if (rank == left) {
+            return n;
+        } else {
+            rank -= left + 1;
+            n = n->right;
+        }
+    }
+    return NULL;
+}
+
+void us_add_list(UserSet *us, const char *names, size_t len) {
+    const char *end = names + len;
+    while (names < end) {
+        const char *nl = memchr(names, '\n', end - names);
+        if (!nl) nl = end;
+        if (nl > names) us_add(us, names, nl - names);
+        names = nl + 1;
+    }
+}
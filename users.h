@@ -0,0 +1,45 @@
+#ifndef USERS_H
+#define USERS_H
+
+#include <stddef.h>
+
+// The current room's users as an order-statistic tree (a treap keyed by
+// name, each node counting its subtree). Insert, remove and lookup by rank
+// are O(log n), so a view can redraw just the rows a change moved. Names
+// need not be unique, so each node counts how many users share it.
+
+typedef struct User {
+    struct User *left, *right;
+    unsigned prio;
+    size_t size;            // nodes in this subtree
+    int count;
+    char name[];
+} User;
+
+typedef struct {
+    User *root;
+    size_t total;           // users, counting shared names
+    unsigned seed;
+} UserSet;
+
+void us_init(UserSet *us);
+void us_clear(UserSet *us);
+void us_free(UserSet *us);
+
+// Distinct names in the set
+static inline size_t us_len(const UserSet *us) {
+    return us->root ? us->root->size : 0;
+}
+
+// Add or remove one user. Both return the rank of the name in sorted
+// order, or -1 if it could not be added or was not in the set.
+long us_add(UserSet *us, const char *name, size_t len);
+long us_remove(UserSet *us, const char *name, size_t len);
+
+// Name at rank, or NULL past the end
+const User *us_at(const UserSet *us, size_t rank);
+
+// Add every name of a newline separated list
+void us_add_list(UserSet *us, const char *names, size_t len);
+
+#endif